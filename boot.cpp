@@ -20,6 +20,12 @@ efi_main (EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable)
   // Store the SystemTable API into the "ST" global.
   ST=SystemTable;
   
+  // Point GS at our per-core data (before anything allocates memory)
+  setup_CPU();
+  setup_memory_functions(); // pick memcpy and memset for this CPU
+  setup_physical_memory(); // take over UEFI's free memory
+  setup_paging(); // PCIDs, if we have them
+  
   // Turn off the watchdog, so we can run indefinitely
   ST->BootServices->SetWatchdogTimer(0, 0, 0, (CHAR16 *)NULL);
   
@@ -32,6 +38,7 @@ efi_main (EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable)
   print("=efi_main ");
 
   setup_GDT();
+  print(" gdt ");
   setup_IDT();
   print("\nBooted OK!\n");
   
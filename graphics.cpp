@@ -38,10 +38,47 @@ KernelBuiltinImages::KernelBuiltinImages()
 // PNG decode library from https://github.com/lvandeve/lodepng
 //  (modified to work in GLaDOS)
 #include "lodepng.h"
+#include "stdlib.h"
+
+/* lodepng's allocators (see LODEPNG_NO_COMPILE_ALLOCATORS in lodepng.h).
+   Inside an ArenaScope, decode temporaries come from the arena.
+   lodepng_realloc needs the old size, so it's stored just before the block. */
+enum {LODEPNG_ARENA_HEADER=16}; // keeps blocks 16-byte aligned
+
+void* lodepng_malloc(size_t size) {
+    Arena *a=Arena::current();
+    if (a==0) return malloc(size);
+    uint64_t *p=(uint64_t *)a->allocate(size+LODEPNG_ARENA_HEADER);
+    p[0]=size;
+    return (char *)p+LODEPNG_ARENA_HEADER;
+}
+
+void* lodepng_realloc(void* ptr, size_t new_size) {
+    Arena *a=Arena::current();
+    if (a==0 || (ptr!=0 && !a->owns(ptr))) return realloc(ptr,new_size);
+    if (ptr==0) return lodepng_malloc(new_size);
+    uint64_t *p=(uint64_t *)((char *)ptr-LODEPNG_ARENA_HEADER);
+    p=(uint64_t *)a->reallocate(p,p[0]+LODEPNG_ARENA_HEADER,new_size+LODEPNG_ARENA_HEADER);
+    p[0]=new_size;
+    return (char *)p+LODEPNG_ARENA_HEADER;
+}
+
+void lodepng_free(void* ptr) {
+    Arena *a=Arena::current();
+    if (a==0 || !a->owns(ptr)) free(ptr);
+    // else the arena gets it back at the end of the ArenaScope
+}
+
+/// Scratch space for decoding PNG images, one at a time
+static Arena pngArena;
+static SpinLock pngLock;
 
 PngImage::PngImage(const void *imageData,uint64_t imageDataBytes)
     :GraphicsOutput<BGRAPixel>(0,0,0,0)
 {
+    lock_guard<SpinLock> guard(pngLock);
+    ArenaScope scope(pngArena);
+    
     unsigned char *pixels=0;
     unsigned lwid=0, lht=0;
     unsigned error=lodepng_decode32(
@@ -53,7 +90,11 @@ PngImage::PngImage(const void *imageData,uint64_t imageDataBytes)
     wid=lwid; ht=lht;
     pixelsPerRow=wid;
     frame=Rect(0,wid,0,ht);
-    framebuffer=(BGRAPixel *)pixels;
+    
+    // The decoded pixels are in pngArena, which gets rewound: keep a copy.
+    uint64_t bytes=sizeof(BGRAPixel)*(uint64_t)wid*ht;
+    framebuffer=(BGRAPixel *)galloc(bytes);
+    memcpy(framebuffer,pixels,bytes);
 }
 
 PngImage::~PngImage()
@@ -149,6 +190,23 @@ EFI_GRAPHICS_OUTPUT_PROTOCOL *get_graphics(void)
     return gfx;
 }
 
+/// Framebuffer copy speed, in bytes per thousand clock cycles:
+///   as the firmware mapped it, and after we made it write-combining.
+uint64_t framebuffer_speed_before=0, framebuffer_speed_after=0;
+
+/// Time copying a whole screen from an offscreen buffer to gfx,
+///   like WindowManager::drawScreen does.  Returns bytes per 1000 cycles.
+uint64_t time_framebuffer_copy(GraphicsOutput<ScreenPixel> &gfx)
+{
+    OffscreenGraphics<ScreenPixel> back(gfx.wid,gfx.ht);
+    gfx.copyTo(gfx.frame,back.frame,back); // copy the screen, so it doesn't change
+    uint64_t start=rdtsc();
+    back.copyTo(back.frame,gfx.frame,gfx);
+    uint64_t cycles=rdtsc()-start;
+    uint64_t bytes=sizeof(ScreenPixel)*(uint64_t)gfx.wid*gfx.ht;
+    return bytes*1000/(cycles+1);
+}
+
 class UEFIGraphics {
 private:
     EFI_GRAPHICS_OUTPUT_PROTOCOL *gfx;
@@ -166,7 +224,20 @@ public:
             info->VerticalResolution,
             info->HorizontalResolution,
             (ScreenPixel *)mode->FrameBufferBase)
-    {}
+    {
+        setup_write_combining();
+    }
+    
+    /// The first time through, make the framebuffer write-combining.
+    ///   Firmware usually maps it uncached, so every pixel is a bus write.
+    void setup_write_combining(void) {
+        static bool done=false;
+        if (done) return;
+        done=true;
+        framebuffer_speed_before=time_framebuffer_copy(out);
+        if (set_write_combining(mode->FrameBufferBase,mode->FrameBufferSize))
+            framebuffer_speed_after=time_framebuffer_copy(out);
+    }
     
     /// Print background info about the graphics resolution and format
     void printInfo(void) {
@@ -178,6 +249,12 @@ public:
         
         print(info->PixelFormat); print(" pixel format (1==BGR_)\n");
         print((uint64_t)out.framebuffer); print(" framebuffer base address\n");
+        
+        print(framebuffer_speed_before); print(" bytes per kilocycle framebuffer copy, as UEFI mapped it\n");
+        if (framebuffer_speed_after) {
+            print(framebuffer_speed_after); print(" bytes per kilocycle write-combining\n");
+        }
+        else print("No PAT, so the framebuffer can't be write-combining\n");
     }
     
 };
@@ -288,7 +365,7 @@ void end_process(Process *doomed)
 bool run_gui=true;
 
 /// Draw a text terminal
-class ProcessTerminal : public Process {
+class ProcessTerminal : public Process, public Pooled<ProcessTerminal> {
 public:
     Font &font;
 	ProcessTerminal(Window &window_)
@@ -10,6 +10,9 @@
 
 // Paranoia / debugging flags:
 #define GLADOS_BOUNDSCHECK 1 /* do bounds checking on array indexes */
+#ifndef GLADOS_LAZY_ZERO
+#define GLADOS_LAZY_ZERO 1 /* gfree marks blocks dirty, they get zeroed later (not in gfree) */
+#endif
 
 #if !GLaDOS_HOSTED
 /// This is compiled with a Windows-type compiler, so 
@@ -46,6 +49,7 @@ extern void check_error(UINT64 error,const char *function,int line);
 #include "utility/ByteBuffer.h"
 #include "utility/Vector.h"
 #include "utility/StringSource.h"
+#include "utility/Lock.h"
 
 /// Take the square root of this float (GLaDOS version, <math.h> not available here)
 extern "C" float sqrtf(float x);
@@ -64,9 +68,17 @@ extern void print(uint64_t value);
 extern void print_hex(uint64_t value,long digits=16,char separator=' ');
 
 #include "arch/PageTable.h"
+#include "arch/CPU.h" // per-core data
+
+/// Pick the fastest memcpy and memset for this CPU (at boot)
+extern void setup_memory_functions(void);
+extern void print_memory_functions(void);
 
 // galloc/gfree allocate/deallocate small chunks of memory:
+#include "memory/buddy.h" // physical pages
 #include "memory/memory.h" // galloc/gfree
+#include "memory/arena.h" // scoped bump allocation
+#include "memory/pool.h" // typed object pools
 
 
 
@@ -99,12 +111,21 @@ inline void sti(void) { __asm__("sti"); }
 /// Reduce idle energy: be kind to the CPU in busy wait
 inline void pause_CPU(void) { __asm__("pause"); }
 
+/// Read the CPU's timestamp counter, which counts clock cycles (roughly)
+inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi<<32)|lo;
+}
+
 /// Called at startup
 extern void setup_GDT(void);
 extern void setup_IDT(void);
 
 /// Load and start executing a linux program
 extern int run_linux(const char *program_name);
+extern void benchmark_syscalls(void);
+extern void toggle_syscall_trace(void);
 
 /// Explore the CPU-OS interface data structures
 extern void print_idt(void);
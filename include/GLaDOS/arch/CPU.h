@@ -0,0 +1,238 @@
+/*
+  Group Led and Designed Operating System (GLaDOS)
+
+  Per-CPU data, so each core can find its own private state
+  (allocator caches, and so on) without taking any locks.
+
+  In the kernel, each core's GS segment base points to its PerCPU struct,
+  so finding our own data is a single "mov rax,gs:[...]" load.
+  In hosted mode (GLaDOS_HOSTED), each thread claims a PerCPU slot instead.
+
+  Dr. Orion Lawlor and the UAF CS 321 class, 2021-03 (Public Domain)
+*/
+#ifndef __GLADOS_ARCH_CPU_H
+#define __GLADOS_ARCH_CPU_H
+
+/// Maximum number of cores we support.  (QEMU "-smp cores=" must be below this.)
+enum {MAX_CPUS=64};
+
+class Arena; // see memory/arena.h
+class PageTable; // see arch/PageTable.h
+
+/// Number of 8-byte descriptors in each core's Global Descriptor Table
+enum {GDT_ENTRIES=16};
+
+/// Segment selectors in our GDT.  UEFI's own segments are below 0x40.
+///   The order is fixed by the syscall and sysret instructions (see STAR).
+enum {
+    SEGMENT_KERNEL_CODE=0x38, ///< UEFI's 64-bit code segment
+    SEGMENT_KERNEL_DATA=0x40, ///< syscall loads SS from here
+    SEGMENT_SYSRET_BASE=0x48, ///< sysret to 32-bit code would use this (unused)
+    SEGMENT_USER_DATA=0x50, ///< sysret loads SS from here, ring 3
+    SEGMENT_USER_CODE=0x58, ///< sysret loads CS from here, ring 3
+    SEGMENT_TSS=0x60, ///< this core's TSS (takes two entries)
+};
+
+#pragma pack(push,4) //<- the CPU defines this layout, with rsp0 at offset 4
+/// 64-bit Task State Segment.  We only use rsp0: the stack the CPU
+///   switches to when an interrupt arrives while running user code.
+struct TaskStateSegment {
+    uint32_t reserved0;
+    uint64_t rsp0; ///< ring 0 stack pointer
+    uint64_t rsp1, rsp2;
+    uint64_t reserved1;
+    uint64_t ist[7]; ///< interrupt stack table (unused)
+    uint64_t reserved2;
+    uint16_t reserved3;
+    uint16_t iomap_base; ///< offset of the I/O permission bitmap
+};
+#pragma pack(pop)
+
+/// Each core gets one of these structs, pointed to by its GS base.
+///  CAUTION: the offsets of the first fields are hardcoded below and in assembly.
+struct PerCPU {
+    PerCPU *self; ///< points to this struct (gs:0)
+    uint64_t index; ///< small dense core number, 0 for the boot core (gs:8)
+    uint64_t kernel_stack; ///< syscalls from user code switch to this stack (gs:16)
+    uint64_t user_rsp; ///< user stack pointer, saved during syscall entry (gs:24)
+    TaskStateSegment *tss; ///< this core's TSS, or 0 before setup_GDT (gs:32)
+    uint64_t apic_id; ///< hardware local APIC ID of this core
+    Arena *arena; ///< innermost ArenaScope's arena on this core (or 0)
+    PageTable *pagetable; ///< address space running on this core (or 0 for the kernel's)
+    bool pcid; ///< this core has PCIDs turned on (CR4.PCIDE)
+    uint64_t kernel_generation; ///< kernel_mapping_generation this core's TLB has caught up to
+    
+    uint64_t gdt[GDT_ENTRIES]; ///< this core's GDT (UEFI's segments, plus ours)
+    TaskStateSegment tss_data; ///< storage for tss
+};
+static_assert(__builtin_offsetof(PerCPU,kernel_stack)==16 && __builtin_offsetof(PerCPU,tss)==32,
+    "PerCPU offsets are hardcoded in util_asm.s");
+static_assert(__builtin_offsetof(TaskStateSegment,rsp0)==4 && sizeof(TaskStateSegment)==104,
+    "TaskStateSegment layout is set by the CPU");
+
+/// Storage for all the cores' PerCPU data
+extern PerCPU percpu[MAX_CPUS];
+
+/// Number of cores that have called setup_CPU so far
+extern int percpu_count;
+
+/// Run the CPUID instruction for this leaf, and store eax,ebx,ecx,edx into regs.
+///   CPUID is slow (and traps in a VM), so only use this during setup.
+inline void cpuid(unsigned int leaf,unsigned int subleaf,unsigned int regs[4]) {
+    unsigned int a=leaf, b=0, c=subleaf, d=0;
+    __asm__ __volatile__("cpuid" : "+a"(a), "=b"(b), "+c"(c), "=d"(d));
+    regs[0]=a; regs[1]=b; regs[2]=c; regs[3]=d;
+}
+
+/// Return the hardware local APIC ID for the core we're running on.
+inline uint64_t cpuid_apic_id(void) {
+    unsigned int r[4];
+    cpuid(1,0,r);
+    return r[1]>>24;
+}
+
+/// CPU features we use, filled in by detect_CPU_features
+struct CPUFeatures {
+    bool erms; ///< Enhanced REP MOVSB/STOSB: "rep movsb" is fast
+    bool fsrm; ///< Fast Short REP MOVSB: "rep movsb" is fast even for small copies
+    bool avx2; ///< 256-bit integer SIMD, and the firmware enabled AVX state
+    bool pdpe1gb; ///< 1GB pages in the page table
+    bool pcid; ///< process-context IDs tag TLB entries
+    bool pat; ///< Page Attribute Table, for write-combining pages
+};
+extern CPUFeatures cpu_features;
+
+/// Run CPUID to fill in cpu_features.  Call once at boot.
+extern void detect_CPU_features(void);
+
+#if !GLaDOS_HOSTED
+/// Return our own core's PerCPU struct (needs setup_CPU on this core first)
+inline PerCPU *this_cpu(void) {
+    PerCPU *p;
+    __asm__ ("mov %%gs:0, %0" : "=r"(p));
+    return p;
+}
+
+/// Return our own core's small dense index, from 0 to MAX_CPUS-1.
+inline int cpu_index(void) {
+    uint64_t i;
+    __asm__ ("mov %%gs:8, %0" : "=r"(i));
+    return (int)i;
+}
+
+/// Set up this core's PerCPU struct and point GS at it.
+///   Call this once on each core before it allocates memory.
+///   Safe to call again, it only sets up each core once.
+extern void setup_CPU(void);
+
+#else /* hosted: each thread claims one PerCPU slot on first use */
+extern thread_local PerCPU *hosted_this_cpu;
+extern PerCPU *hosted_claim_CPU(void);
+
+inline PerCPU *this_cpu(void) {
+    PerCPU *p=hosted_this_cpu;
+    if (p==0) p=hosted_claim_CPU();
+    return p;
+}
+inline int cpu_index(void) { return (int)this_cpu()->index; }
+#endif
+
+
+#if GLaDOS_IMPLEMENT_MEMORY /* definitions, in util.cpp */
+PerCPU percpu[MAX_CPUS];
+int percpu_count=0;
+CPUFeatures cpu_features;
+
+void detect_CPU_features(void)
+{
+    unsigned int r1[4], r7[4]={0,0,0,0};
+    cpuid(0,0,r1);
+    unsigned int max_leaf=r1[0];
+    cpuid(1,0,r1);
+    if (max_leaf>=7) cpuid(7,0,r7);
+    
+    cpu_features.pcid=(r1[2]>>17)&1; // leaf 1 ecx bit 17
+    cpu_features.pat=(r1[3]>>16)&1; // leaf 1 edx bit 16
+    cpu_features.erms=(r7[1]>>9)&1; // leaf 7 ebx bit 9
+    cpu_features.fsrm=(r7[3]>>4)&1; // leaf 7 edx bit 4
+    
+    // AVX2 needs CPU support, plus the OS (here, UEFI) saving ymm registers
+    bool avx2=(r7[1]>>5)&1; // leaf 7 ebx bit 5
+    bool osxsave=(r1[2]>>27)&1; // leaf 1 ecx bit 27
+    if (avx2 && osxsave) {
+        unsigned int xcr0_lo, xcr0_hi;
+        __asm__ __volatile__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+        avx2=(xcr0_lo&6)==6; // SSE and AVX state are enabled
+    }
+    else avx2=false;
+    cpu_features.avx2=avx2;
+    
+    cpuid(0x80000000,0,r1);
+    if (r1[0]>=0x80000001) {
+        cpuid(0x80000001,0,r1);
+        cpu_features.pdpe1gb=(r1[3]>>26)&1; // extended leaf 1 edx bit 26
+    }
+}
+
+#if !GLaDOS_HOSTED
+extern "C" uint64_t read_msr(uint64_t msr); //< in util_asm.s
+extern "C" void write_msr(uint64_t msr,uint64_t value); //< in util_asm.s
+enum {MSR_GS_BASE=0xC0000101};
+
+void setup_CPU(void)
+{
+    uint64_t apic=cpuid_apic_id();
+
+    // Are we already set up?  (GS base is garbage before this)
+    PerCPU *old=(PerCPU *)read_msr(MSR_GS_BASE);
+    if (old>=&percpu[0] && old<&percpu[MAX_CPUS] && old->self==old && old->apic_id==apic)
+        return;
+
+    int i=__atomic_fetch_add(&percpu_count,1,__ATOMIC_SEQ_CST);
+    if (i>=MAX_CPUS) panic("Too many CPU cores for MAX_CPUS: ",i);
+    PerCPU *p=&percpu[i];
+    p->self=p;
+    p->index=i;
+    p->apic_id=apic;
+    write_msr(MSR_GS_BASE,(uint64_t)p);
+}
+
+#else /* hosted */
+thread_local PerCPU *hosted_this_cpu=0;
+
+// Give our slot back when the thread exits, so the next thread can reuse it.
+//   (Any allocator caches stay in the slot, so nothing leaks.)
+struct hosted_CPU_release {
+    ~hosted_CPU_release() {
+        if (hosted_this_cpu) __atomic_store_n(&hosted_this_cpu->apic_id,0,__ATOMIC_RELEASE);
+    }
+};
+thread_local hosted_CPU_release hosted_release_at_exit;
+
+PerCPU *hosted_claim_CPU(void)
+{
+    // apic_id is used as the "in use" flag for hosted slots
+    for (int i=0;i<MAX_CPUS;i++) {
+        uint64_t unused=0;
+        if (__atomic_compare_exchange_n(&percpu[i].apic_id,&unused,1,
+            false,__ATOMIC_ACQUIRE,__ATOMIC_RELAXED))
+        {
+            PerCPU *p=&percpu[i];
+            p->self=p;
+            p->index=i;
+            hosted_this_cpu=p;
+            (void)&hosted_release_at_exit; // make sure the release object exists
+            int n=__atomic_load_n(&percpu_count,__ATOMIC_RELAXED);
+            while (n<i+1 && !__atomic_compare_exchange_n(&percpu_count,&n,i+1,
+                false,__ATOMIC_SEQ_CST,__ATOMIC_RELAXED)) {}
+            return p;
+        }
+    }
+    panic("Too many hosted threads for MAX_CPUS",MAX_CPUS);
+    return 0;
+}
+#endif
+
+#endif
+
+#endif
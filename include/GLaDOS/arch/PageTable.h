@@ -18,6 +18,20 @@ typedef uint64_t VirtualAddress;
 /// Page size, in bytes
 enum {PageSize=4096}; 
 
+/// Take over all the free memory in the UEFI memory map.  Call once at boot,
+///  before anything calls the page allocators below.
+void setup_physical_memory(void);
+
+/// Memory below this is left alone: real mode code (like the AP startup trampoline)
+///  lives below 1MB, and Linux programs are linked at 4MB, where the
+///  kernel's identity mapping gets covered up by the program's pages.
+enum {LOW_MEMORY=16*1024*1024};
+
+/// End of the physical memory the page allocators hand out.  Programs
+///  mustn't cover LOW_MEMORY up to here, since the kernel fills their
+///  pages through its identity mapping.
+PhysicalAddress physical_memory_end(void);
+
 /// Page allocator: allocates one 4KB page of physical memory.
 ///  If no physical memory is free, this panics.
 PhysicalAddress AllocatePage(void);
@@ -25,6 +39,32 @@ PhysicalAddress AllocatePage(void);
 /// Deallocate this 4KB page of physical memory.
 void DeallocatePage(PhysicalAddress base);
 
+/// Add a reference to this allocated 4KB page, so it can be mapped in
+///  more than one place (e.g., shared copy-on-write after a fork).
+void SharePage(PhysicalAddress page);
+
+/// Drop one reference to this 4KB page: the last reference deallocates it.
+void ReleasePage(PhysicalAddress page);
+
+/// Return true if anybody else has a reference to this 4KB page.
+bool PageShared(PhysicalAddress page);
+
+/// Large ("huge") page size, in bytes
+enum {LargePageSize=2*1024*1024};
+
+/// Allocates this many contiguous 4KB pages of physical memory, 
+///  starting at a multiple of align bytes (a power of two, PageSize or more).
+///  At most 1GB can be allocated at once.
+///  If no physical memory is free, this panics.
+PhysicalAddress AllocatePages(uint64_t count,uint64_t align=PageSize);
+
+/// Deallocate these contiguous pages (from AllocatePages) of physical memory.
+void DeallocatePages(PhysicalAddress base,uint64_t count);
+
+/// Try to allocate these exact contiguous pages (e.g., to grow an allocation).
+///  Returns false if any of them are already in use.
+bool AllocatePagesAt(PhysicalAddress base,uint64_t count);
+
 
 /// Abstract Page access permissions
 /// PagePermissions include: read, write, execute, and userspace access
@@ -60,25 +100,170 @@ private:
 
 
 
+class PageTable;
+
+/// Page fault error code bits, pushed by the CPU
+enum {
+    PF_PRESENT=1, ///< the page was present (so this is a permissions problem)
+    PF_WRITE=2, ///< the access was a write
+    PF_USER=4, ///< the access came from user mode
+    PF_INSTRUCTION=16 ///< the access was an instruction fetch
+};
+
+/// Fills in a PageTable's pages when they're first touched (demand paging).
+class PageFaultHandler {
+public:
+    /// Access to addr (not page aligned) caused a page fault with this error code.
+    ///  Map a page there and return true, or return false if it's a real crash.
+    virtual bool handle_page_fault(PageTable &pagetable,VirtualAddress addr,uint64_t error) =0;
+};
+
+/// Flushing more pages than this, it's faster to flush a core's 
+///   whole TLB than to invlpg each page.  (Same cutoff as Linux.)
+enum {TLB_FULL_FLUSH_PAGES=33};
+
+/// Stale TLB entries waiting to be flushed, all together.
+struct TLBBatch {
+    enum {MAX_RANGES=8};
+    int count; // number of ranges
+    uint64_t pages; // total pages in all the ranges
+    VirtualAddress start[MAX_RANGES];
+    uint64_t bytes[MAX_RANGES];
+    
+    TLBBatch() { clear(); }
+    void clear(void) { count=0; pages=0; }
+    bool empty(void) const { return pages==0; }
+    
+    /// Add this range of addresses (merging it with the last range if they touch)
+    void add(VirtualAddress map,uint64_t len) {
+        pages+=(len+PageSize-1)/PageSize;
+        if (count>0 && start[count-1]+bytes[count-1]==map) bytes[count-1]+=len;
+        else if (count<MAX_RANGES) { start[count]=map; bytes[count]=len; count++; }
+        else pages+=TLB_FULL_FLUSH_PAGES; // too many ranges to track
+    }
+    
+    /// Return true if we should flush everything instead
+    bool full_flush(void) const { return pages>TLB_FULL_FLUSH_PAGES; }
+};
+
+
 /// Page Table: a hardware-coupled data structure used to 
 ///  translate virtual addresses into physical addresses.
+///
+/// Each PageTable is one address space.  It starts out with all the
+///  kernel's mappings (shared, not copied), and gets its own pagemaps
+///  only along the paths where you add pages.
+/// If the CPU has process-context IDs (PCIDs), each PageTable's TLB 
+///  entries are tagged with its own ID, so switching address spaces
+///  doesn't flush the TLB.
 class PageTable {
 public:
     PageTable() {
         base=0; ///<- lazy allocation on use
+        pcid=0;
+        cpus_used=0;
+        fault_handler=0;
+        cow_copies=0;
     }
     
+    /// Frees our pagemaps (but not the pages they map).
+    ~PageTable();
+    
     /// Add a page with these permissions to this pagetable:
     void add(PhysicalAddress page,VirtualAddress map,
         SetOfPagePermissions perm);
     
+    /// Add bytes of contiguous physical memory starting at page, 
+    ///   mapped starting at virtual address map.  Uses 2MB or 1GB
+    ///   pages wherever both addresses are aligned for them.
+    void add_range(PhysicalAddress page,VirtualAddress map,uint64_t bytes,
+        SetOfPagePermissions perm);
+    
+    /// Remove the pages we added from map to map+bytes (access will #PF).
+    ///   Stale TLB entries stay around until you call flush_TLB.
+    void remove_range(VirtualAddress map,uint64_t bytes);
+    
+    /// Change the permissions of the pages we added from map to map+bytes.
+    ///   Stale TLB entries stay around until you call flush_TLB.
+    void protect_range(VirtualAddress map,uint64_t bytes,SetOfPagePermissions perm);
+    
+    /// Remember the TLB entries for these addresses are stale.
+    void invalidate(VirtualAddress map,uint64_t bytes) { stale.add(map,bytes); }
+    
+    /// Flush all our stale TLB entries, on every core that might have them.
+    ///  Cores running this address space get one IPI each; 
+    ///  cores that ran it before just flush it when they switch back.
+    void flush_TLB(void);
+    
+    /// ReleasePage each page we added from map to map+bytes, and remove them.
+    ///   Only for pages that came from AllocatePage (not device memory).
+    void release_pages(VirtualAddress map,uint64_t bytes);
+    
+    /// Give child (which must be empty) all our pages, copy-on-write: 
+    ///   writable pages turn read-only in both of us, and whoever writes 
+    ///   first gets a private copy.  Pages must come from AllocatePage.
+    void clone(PageTable &child);
+    
+    /// Add a page another PageTable has too (it must come from AllocatePage):
+    ///   it gets another reference, and if perm is Writable it's copy-on-write.
+    void add_shared(PhysicalAddress page,VirtualAddress map,SetOfPagePermissions perm);
+    
+    /// A write to this copy-on-write page faulted: make it writable, 
+    ///   copying it first if it's still shared.  Returns false if 
+    ///   addr isn't a copy-on-write page.
+    bool copy_on_write(VirtualAddress addr);
+    
+    /// Number of pages copy_on_write has had to copy
+    uint64_t cow_copies;
+    
+    /// Return the physical address this pagetable maps at this virtual address,
+    ///   or 0 if we haven't added a page there (kernel mappings don't count).
+    PhysicalAddress lookup(VirtualAddress map);
+    
+    /// Page faults in this address space go to this handler (or 0 for none)
+    void set_fault_handler(PageFaultHandler *handler) { fault_handler=handler; }
+    
+    /// Called by the #PF interrupt: returns true if we or our handler fixed it.
+    bool handle_page_fault(VirtualAddress addr,uint64_t error) {
+        if ((error&PF_PRESENT) && (error&PF_WRITE) && copy_on_write(addr)) return true;
+        return fault_handler && fault_handler->handle_page_fault(*this,addr,error);
+    }
+    
     /// Swap in this pagetable to be the current one used by the hardware:
     void activate(void);
     
+    /// Swap back to the kernel's pagetable on this core.
+    static void deactivate(void);
+    
 private:
     PhysicalAddress base; ///<- hardware-specific start of storage.
+    uint64_t pcid; ///<- process-context ID tagging our TLB entries
+    uint64_t cpus_used; ///<- bitmask of cores that may have our TLB entries
+    TLBBatch stale; ///<- TLB entries waiting for flush_TLB
+    PageFaultHandler *fault_handler; ///<- fills in pages on demand (or 0)
+    
+    void make_base(void);
+    
+    // Don't copy (two owners of the same pagemaps)
+    PageTable(const PageTable &copy) = delete;
+    void operator=(const PageTable &copy) = delete;
 };
 
+/// Show how many TLB shootdowns we've done, and how long they took.
+void print_TLB_stats(void);
+
+/// Set up paging on this core: turn on PCIDs if the CPU has them,
+///  and program the PAT so pages can be write-combining.
+///  Call once on each core, after setup_CPU.
+void setup_paging(void);
+
+/// Make the kernel's mapping of these addresses write-combining: writes 
+///  collect in the CPU's write-combining buffers and go out as bursts,
+///  which is much faster for framebuffers than uncached.  Edits the
+///  kernel's pagemaps in place, and makes every core flush its TLB.
+///  Returns false if the CPU doesn't have a PAT.
+bool set_write_combining(VirtualAddress start,uint64_t bytes);
+
 
 
 
@@ -292,16 +292,22 @@ public:
     }
 };
 
-// Stores our pixel data in an offscreen buffer
+// Stores our pixel data in an offscreen buffer.
+//   Rows start cache-line aligned if wid*sizeof(Pixel) is a multiple of 64,
+//   so SIMD pixel loops can use aligned loads and stores.
+//   (Pixels start all zero, like the Pixel() constructors.)
 template <class Pixel>
 class OffscreenGraphics : public GraphicsOutput<Pixel>
 {
 public:
+    enum { ALIGN=64 }; // bytes of alignment for the framebuffer
+    
     OffscreenGraphics(int wid_,int ht_)
-        :GraphicsOutput<Pixel>(wid_,ht_,wid_,new Pixel[wid_*ht_])
+        :GraphicsOutput<Pixel>(wid_,ht_,wid_,
+            (Pixel *)galloc_aligned(sizeof(Pixel)*(uint64_t)wid_*ht_,ALIGN))
     {}
     ~OffscreenGraphics() {
-        delete[] this->framebuffer; this->framebuffer=0;
+        gfree(this->framebuffer); this->framebuffer=0;
     }
 };
 
@@ -21,7 +21,7 @@
 
 
 /// A Window is a box visible onscreen.
-class Window {
+class Window : public Pooled<Window> {
 public:
     // Part of the IntrusiveList interface:
     Window *next;
@@ -162,7 +162,8 @@ public:
     virtual void drawAllWindows(GraphicsOutput<ScreenPixel> &gfx)
     {
         // Draw windows back-to-front (currently in wrong stack order)
-        vector<Window *> reorder;
+        ArenaScope scope(frameArena);
+        vector<Window *,ArenaAllocator> reorder;
         for (Window &w:windows) reorder.push_back(&w);
         for (int i=reorder.size()-1;i>=0;i--)
         {
@@ -277,6 +278,9 @@ private:
 /// This is the list of all the windows currently onscreen,
 ///   sorted by Z order, topmost first.
     IntrusiveList<Window> windows;
+
+/// Temporaries used while drawing one frame
+    Arena frameArena;
 }; 
 
 
@@ -0,0 +1,262 @@
+/*
+  Arena ("bump") allocator, for lots of short-lived temporaries.
+
+  Allocating from an arena is just moving a pointer forward.
+  Nothing gets freed one block at a time: the whole arena gets
+  rewound at once, typically by an ArenaScope at the end of a
+  frame or function call.  The arena keeps its chunks of memory,
+  so the next frame's temporaries cost no galloc calls at all.
+
+  Group Led and Designed Operating System (GLaDOS)
+  A UEFI-based C++ operating system.
+
+  Dr. Orion Lawlor and the UAF CS 321 class, 2021-03 (Public Domain)
+*/
+#ifndef __GLADOS_MEMORY_ARENA_H
+#define __GLADOS_MEMORY_ARENA_H
+
+/// Arenas get memory from galloc in chunks at least this big
+enum { ARENA_CHUNK=64*1024 };
+
+/// When an arena is rewound to empty, it keeps this many bytes of chunks
+enum { ARENA_KEEP=1024*1024 };
+
+/// One galloc'd chunk of arena memory.  The data follows this header.
+struct ArenaChunk {
+    ArenaChunk *next; // next chunk in this arena, or 0
+    uint64_t size; // bytes of data in this chunk
+
+    char *data(void) { return (char *)(this+1); }
+    char *data_end(void) { return data()+size; }
+};
+
+/// Remembers a spot in an arena, so we can rewind back to it.
+struct ArenaMark {
+    ArenaChunk *chunk;
+    char *cur;
+};
+
+/**
+ A bump allocator.  Memory from an arena is NOT zeroed, and
+ destructors don't run when it's rewound, so it's meant for
+ plain data like pointers, pixels, and characters.
+
+ Thread safety: none, only one core may use an arena at once.
+*/
+class Arena {
+public:
+    Arena() { first=chunk=0; cur=end=0; scopes=0; }
+    ~Arena() { release(); }
+
+    /// Allocate this many bytes, aligned to align (a power of two).
+    inline void *allocate(uint64_t bytes,uint64_t align=16) {
+        char *p=(char *)(((uint64_t)cur+align-1)&~(align-1));
+        if (cur==0 || p+bytes>end) return allocate_slow(bytes,align);
+        cur=p+bytes;
+        return p;
+    }
+
+    /// Resize this block from old_bytes to new_bytes.  If it was the
+    ///  last thing allocated, this is free; otherwise it copies.
+    void *reallocate(void *ptr,uint64_t old_bytes,uint64_t new_bytes,uint64_t align=16);
+
+    /// Return true if this pointer came from this arena.
+    bool owns(const void *ptr) const;
+
+    /// Return a mark at the current spot, to rewind to later.
+    ArenaMark mark(void) const {
+        ArenaMark m; m.chunk=chunk; m.cur=cur;
+        return m;
+    }
+
+    /// Throw away everything allocated since this mark (but keep the memory)
+    void rewind(const ArenaMark &m) {
+        chunk=m.chunk; cur=m.cur;
+        end=chunk?chunk->data_end():0;
+    }
+
+    /// Throw away everything allocated (but keep the memory)
+    void reset(void) {
+        chunk=first;
+        cur=first?first->data():0;
+        end=first?first->data_end():0;
+    }
+
+    /// Return true if nothing is currently allocated from this arena
+    bool empty(void) const {
+        return cur==0 || (chunk==first && cur==first->data());
+    }
+
+    /// gfree unused chunks past the current one, keeping keep_bytes of chunks.
+    ///  An empty arena bigger than keep_bytes gets released entirely.
+    void trim(uint64_t keep_bytes);
+
+    /// Throw away everything allocated, and gfree all our memory.
+    void release(void);
+
+    /// Return this core's current arena (from the innermost ArenaScope), or 0.
+    static Arena *current(void) { return this_cpu()->arena; }
+
+private:
+    ArenaChunk *first; // first chunk in our list (or 0)
+    ArenaChunk *chunk; // chunk we're allocating from now
+    char *cur; // next free byte in chunk
+    char *end; // end of chunk
+    friend class ArenaScope;
+    int scopes; // number of ArenaScopes currently using this arena
+
+    /// Called when the current chunk is full
+    void *allocate_slow(uint64_t bytes,uint64_t align);
+
+    // Don't copy arenas (double free of chunks)
+    Arena(const Arena &copy) = delete;
+    void operator=(const Arena &copy) = delete;
+};
+
+
+/**
+ Makes this arena the current arena on this core, until the scope ends.
+ Then everything allocated from it inside the scope gets thrown away.
+   {
+      ArenaScope scope(frameArena);
+      vector<Window *,ArenaAllocator> temp; // uses frameArena
+      ...
+   } // <- temp and everything else from frameArena is gone.
+ CAUTION: don't yield to another thread inside an ArenaScope.
+*/
+class ArenaScope {
+public:
+    ArenaScope(Arena &a) :arena(a), start(a.mark()) {
+        arena.scopes++;
+        PerCPU *cpu=this_cpu();
+        previous=cpu->arena;
+        cpu->arena=&arena;
+    }
+    ~ArenaScope() {
+        this_cpu()->arena=previous;
+        arena.rewind(start);
+        if (--arena.scopes==0 && arena.empty()) 
+            arena.trim(ARENA_KEEP); // e.g., after decoding a huge image
+    }
+private:
+    Arena &arena;
+    ArenaMark start;
+    Arena *previous;
+
+    ArenaScope(const ArenaScope &copy) = delete;
+    void operator=(const ArenaScope &copy) = delete;
+};
+
+
+/**
+ vector allocation policy that uses this core's current arena.
+ With no ArenaScope active, it falls back to new and delete.
+ An arena vector must not outlive the ArenaScope it was filled in.
+*/
+struct ArenaAllocator {
+    template <class T>
+    static T *allocate(uint64_t n) {
+        Arena *a=Arena::current();
+        if (a==0) return new T[n];
+        T *p=(T *)a->allocate(n*sizeof(T),alignof(T));
+        for (uint64_t i=0;i<n;i++) new (&p[i]) T();
+        return p;
+    }
+
+    template <class T>
+    static void deallocate(T *p,uint64_t n) {
+        Arena *a=Arena::current();
+        if (a && a->owns(p)) { // memory comes back when the scope ends
+            for (uint64_t i=0;i<n;i++) p[i].~T();
+        }
+        else delete[] p;
+    }
+};
+
+
+
+
+#if GLaDOS_IMPLEMENT_MEMORY /* definitions, in util.cpp */
+
+void *Arena::allocate_slow(uint64_t bytes,uint64_t align)
+{
+    // Move on to the next chunk we already have, if it's big enough
+    ArenaChunk *next=chunk?chunk->next:first;
+    if (next && next->size>=bytes+align) {
+        chunk=next;
+    }
+    else
+    { // Need a new chunk, linked in right after the current one
+        uint64_t size=bytes+align;
+        if (size<ARENA_CHUNK) size=ARENA_CHUNK;
+        ArenaChunk *c=(ArenaChunk *)galloc(sizeof(ArenaChunk)+size);
+        c->size=size;
+        if (chunk) { c->next=chunk->next; chunk->next=c; }
+        else { c->next=first; first=c; }
+        chunk=c;
+    }
+    cur=chunk->data();
+    end=chunk->data_end();
+    return allocate(bytes,align);
+}
+
+void *Arena::reallocate(void *ptr,uint64_t old_bytes,uint64_t new_bytes,uint64_t align)
+{
+    char *p=(char *)ptr;
+    if (p && p+old_bytes==cur && p+new_bytes<=end)
+    { // we were the last allocation: just move the end
+        cur=p+new_bytes;
+        return p;
+    }
+    void *nu=allocate(new_bytes,align);
+    if (p) __builtin_memcpy(nu,p,old_bytes<new_bytes?old_bytes:new_bytes);
+    return nu;
+}
+
+bool Arena::owns(const void *ptr) const
+{
+    for (ArenaChunk *c=first;c!=0;c=c->next)
+        if ((const char *)ptr>=c->data() && (const char *)ptr<c->data_end())
+            return true;
+    return false;
+}
+
+void Arena::trim(uint64_t keep_bytes)
+{
+    ArenaChunk *keep=chunk?chunk:first; // last chunk we keep
+    if (keep==0) return;
+    if (empty() && first->size>keep_bytes) { release(); return; }
+    uint64_t kept=0;
+    for (ArenaChunk *c=first;c!=keep->next;c=c->next) kept+=c->size;
+
+    // Walk the unused chunks after keep, freeing any over our budget
+    ArenaChunk **link=&keep->next;
+    while (*link) {
+        ArenaChunk *c=*link;
+        if (kept+c->size<=keep_bytes) {
+            kept+=c->size;
+            link=&c->next;
+        }
+        else {
+            *link=c->next;
+            gfree(c);
+        }
+    }
+}
+
+void Arena::release(void)
+{
+    ArenaChunk *c=first;
+    while (c) {
+        ArenaChunk *next=c->next;
+        gfree(c);
+        c=next;
+    }
+    first=chunk=0;
+    cur=end=0;
+}
+
+#endif
+
+#endif
+
@@ -0,0 +1,400 @@
+/*
+  Buddy allocator for physical memory pages.
+
+  Free memory is kept in blocks of 2^order pages, each starting at a
+  multiple of its own size.  Splitting a block makes two "buddies";
+  when a block is freed and its buddy is free too, they merge back
+  into the bigger block.  So allocating or freeing takes O(log n) steps,
+  and whole 2MB and 1GB blocks stay available for huge pages.
+  Knuth, The Art of Computer Programming vol 1, section 2.5.
+
+  Group Led and Designed Operating System (GLaDOS)
+  A UEFI-based C++ operating system.
+
+  Dr. Orion Lawlor and the UAF CS 321 class, 2021-03 (Public Domain)
+*/
+#ifndef __GLADOS_MEMORY_BUDDY_H
+#define __GLADOS_MEMORY_BUDDY_H
+
+/// Block orders: order 0 is one 4KB page, order 9 is 2MB, order 18 is 1GB.
+enum { BUDDY_MAX_ORDER=18, BUDDY_ORDERS=BUDDY_MAX_ORDER+1 };
+
+/// A free block of pages.  The links live inside the free block itself.
+struct buddy_block {
+    buddy_block *next;
+    buddy_block *prev;
+};
+
+/**
+ Hands out contiguous physical pages, from 4KB up to 1GB.
+ Blocks are always aligned to their size, so a 2MB block
+ can be mapped as a single large page.
+
+ Free memory must be writable at its physical address
+ (UEFI identity maps everything), because the free lists
+ are stored in the free pages.
+
+ Thread safety: any core can allocate and free at once.
+*/
+class PageBuddy {
+public:
+    PageBuddy() {
+        lo=hi=0; state=0; refs=0;
+        for (int o=0;o<BUDDY_ORDERS;o++) { lists[o]=0; counts[o]=0; }
+        free_count=total=0;
+    }
+
+    /// Bytes of bookkeeping needed to manage physical addresses lo to hi.
+    static uint64_t meta_bytes(PhysicalAddress lo,PhysicalAddress hi) {
+        return refs_offset(lo,hi)+(hi-lo)/PageSize*sizeof(uint32_t);
+    }
+
+    /// Get ready to manage physical addresses from lo up to hi (page aligned).
+    ///  meta must point to meta_bytes(lo,hi) bytes of zeros.
+    ///  No pages are free until you add them.
+    void setup(PhysicalAddress lo,PhysicalAddress hi,uint8_t *meta);
+
+    /// Add these free pages, which must be between lo and hi.
+    void add(PhysicalAddress base,uint64_t count);
+
+    /// Allocate count contiguous pages, starting at a multiple of align bytes.
+    ///  Returns 0 if there isn't a free block that big (max 1GB).
+    PhysicalAddress allocate(uint64_t count,uint64_t align=PageSize);
+
+    /// Free count pages starting at base (from allocate or allocate_at).
+    ///  Any part of an allocation can be freed separately.
+    void free(PhysicalAddress base,uint64_t count);
+
+    /// Allocate exactly these pages.  Returns false if any are in use.
+    bool allocate_at(PhysicalAddress base,uint64_t count);
+
+    /// Allocate up to n single pages into out, taking the lock once.
+    ///  Returns the number of pages allocated (0 if we're out of memory).
+    uint64_t allocate_batch(PhysicalAddress *out,uint64_t n);
+
+    /// Free these n single pages, taking the lock once.
+    void free_batch(const PhysicalAddress *pages,uint64_t n);
+
+    /// Add a reference to this allocated page (e.g., it's mapped copy-on-write
+    ///  into one more address space).  Doesn't need the lock.
+    void share(PhysicalAddress p) { __atomic_fetch_add(&refs_of(p),1,__ATOMIC_RELAXED); }
+
+    /// Drop a reference to this allocated page.  Returns true if that 
+    ///  was the last reference, so the caller should free the page.
+    bool unshare(PhysicalAddress p);
+
+    /// Number of references to this allocated page besides the first one
+    uint32_t sharers(PhysicalAddress p) { return __atomic_load_n(&refs_of(p),__ATOMIC_ACQUIRE); }
+
+    /// Number of pages free now
+    uint64_t free_pages(void) const { return free_count; }
+    /// Number of pages we manage (free or allocated)
+    uint64_t total_pages(void) const { return total; }
+    /// End of the physical addresses we manage
+    PhysicalAddress end_address(void) const { return hi; }
+    /// Number of free blocks of this order
+    uint64_t free_blocks(int order) const { return counts[order]; }
+
+    /// Show the free block counts for each order
+    void print_stats(void);
+
+private:
+    SpinLock lock; // protects everything below
+    PhysicalAddress lo, hi; // range of physical addresses we manage
+    /// One byte per page: FREE|order for the first page of a free block, else 0.
+    uint8_t *state;
+    enum { FREE=0x80 };
+    /// One count per page: references beyond the first (0 for most pages).
+    uint32_t *refs;
+    buddy_block *lists[BUDDY_ORDERS]; // doubly linked lists of free blocks
+    uint64_t counts[BUDDY_ORDERS]; // number of free blocks in each list
+    uint64_t free_count; // pages free
+    uint64_t total; // pages added
+
+    // Reference counts are atomic, so they don't need the lock
+    uint32_t &refs_of(PhysicalAddress p) {
+        if (p<lo || p>=hi) panic("PageBuddy reference count outside managed memory: ",p);
+        return refs[(p-lo)/PageSize];
+    }
+    /// The reference counts start after the state bytes, 8-byte aligned
+    static uint64_t refs_offset(PhysicalAddress lo,PhysicalAddress hi) {
+        return ((hi-lo)/PageSize+7)&~7ull;
+    }
+
+    // These helpers need the lock already held:
+    static uint64_t block_bytes(int order) { return ((uint64_t)PageSize)<<order; }
+    uint8_t &state_of(PhysicalAddress p) { return state[(p-lo)/PageSize]; }
+    void push(PhysicalAddress b,int order);
+    void remove(PhysicalAddress b,int order);
+    PhysicalAddress allocate_order(int order);
+    void free_block(PhysicalAddress b,int order);
+    void free_range(PhysicalAddress base,uint64_t count);
+    bool find_free_block(PhysicalAddress p,PhysicalAddress &start,int &order);
+
+    // Don't copy (two owners of the same free lists)
+    PageBuddy(const PageBuddy &copy) = delete;
+    void operator=(const PageBuddy &copy) = delete;
+};
+
+/// The kernel's physical memory (used by AllocatePages)
+extern PageBuddy physical_pages;
+
+
+/**
+ Each core keeps a few free 4KB pages of its own, so page faults and
+ page table builds on several cores don't all fight over the buddy lock.
+ The cache refills or drains PAGE_CACHE_BATCH pages at a time,
+ so the lock is taken once per batch instead of once per page.
+ Only the owning core may touch its cache, so it needs no locks.
+*/
+enum { PAGE_CACHE_SIZE=64, PAGE_CACHE_BATCH=32 };
+struct page_cpu_cache {
+    uint64_t count; // number of valid pages, top of stack at count-1
+    PhysicalAddress pages[PAGE_CACHE_SIZE];
+    
+    uint64_t hits; // allocations served from the cache
+    uint64_t misses; // allocations that had to refill from physical_pages
+    uint64_t drains; // frees that had to drain to physical_pages
+};
+extern page_cpu_cache page_caches[MAX_CPUS];
+
+/// Allocate one 4KB page from this core's cache.  Returns 0 if out of memory.
+inline PhysicalAddress page_cache_allocate(void) {
+    page_cpu_cache &c=page_caches[cpu_index()];
+    if (c.count>0) {
+        c.hits++;
+        return c.pages[--c.count];
+    }
+    c.misses++;
+    c.count=physical_pages.allocate_batch(c.pages,PAGE_CACHE_BATCH);
+    if (c.count==0) return 0;
+    return c.pages[--c.count];
+}
+
+/// Free one 4KB page into this core's cache.
+inline void page_cache_free(PhysicalAddress page) {
+    page_cpu_cache &c=page_caches[cpu_index()];
+    if (c.count>=PAGE_CACHE_SIZE) {
+        c.drains++;
+        c.count-=PAGE_CACHE_BATCH;
+        physical_pages.free_batch(&c.pages[c.count],PAGE_CACHE_BATCH);
+    }
+    c.pages[c.count++]=page;
+}
+
+/// Show each core's page cache hits and misses
+void print_page_cache_stats(void);
+
+
+
+
+#if GLaDOS_IMPLEMENT_MEMORY /* definitions, in util.cpp */
+
+void PageBuddy::setup(PhysicalAddress lo_,PhysicalAddress hi_,uint8_t *meta)
+{
+    lock_guard<SpinLock> guard(lock);
+    lo=lo_; hi=hi_; state=meta;
+    refs=(uint32_t *)(meta+refs_offset(lo,hi));
+}
+
+bool PageBuddy::unshare(PhysicalAddress p)
+{
+    uint32_t &r=refs_of(p);
+    uint32_t n=__atomic_load_n(&r,__ATOMIC_ACQUIRE);
+    while (n>0) // somebody else still has it: just drop our reference
+        if (__atomic_compare_exchange_n(&r,&n,n-1,false,__ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE))
+            return false;
+    return true;
+}
+
+void PageBuddy::add(PhysicalAddress base,uint64_t count)
+{
+    if (base<lo || base+count*PageSize>hi || (base&(PageSize-1)))
+        panic("PageBuddy::add outside managed memory: ",base);
+    lock_guard<SpinLock> guard(lock);
+    total+=count;
+    free_range(base,count);
+}
+
+PhysicalAddress PageBuddy::allocate(uint64_t count,uint64_t align)
+{
+    if (count==0) count=1;
+    int order=0;
+    while ((1ull<<order)<count || block_bytes(order)<align) {
+        order++;
+        if (order>BUDDY_MAX_ORDER) return 0; // bigger than our biggest block
+    }
+
+    lock_guard<SpinLock> guard(lock);
+    PhysicalAddress b=allocate_order(order);
+    if (b==0) return 0;
+
+    // Give back the pages past count (e.g., 3 pages come from a 4-page block)
+    uint64_t extra=(1ull<<order)-count;
+    if (extra) free_range(b+count*PageSize,extra);
+    return b;
+}
+
+void PageBuddy::free(PhysicalAddress base,uint64_t count)
+{
+    if (base<lo || base+count*PageSize>hi || (base&(PageSize-1)))
+        panic("PageBuddy::free of memory we don't manage: ",base);
+    lock_guard<SpinLock> guard(lock);
+    free_range(base,count);
+}
+
+bool PageBuddy::allocate_at(PhysicalAddress base,uint64_t count)
+{
+    PhysicalAddress end=base+count*PageSize;
+    if (base<lo || end>hi || (base&(PageSize-1))) return false;
+    lock_guard<SpinLock> guard(lock);
+
+    // First make sure every page is free, without changing anything
+    PhysicalAddress s;
+    int order;
+    for (PhysicalAddress p=base;p<end;p=s+block_bytes(order))
+        if (!find_free_block(p,s,order)) return false;
+
+    // Now take each free block, and give back the parts outside base..end
+    for (PhysicalAddress p=base;p<end;) {
+        find_free_block(p,s,order);
+        remove(s,order);
+        PhysicalAddress block_end=s+block_bytes(order);
+        PhysicalAddress e=block_end<end?block_end:end;
+        if (p>s) free_range(s,(p-s)/PageSize);
+        if (block_end>e) free_range(e,(block_end-e)/PageSize);
+        p=e;
+    }
+    return true;
+}
+
+uint64_t PageBuddy::allocate_batch(PhysicalAddress *out,uint64_t n)
+{
+    lock_guard<SpinLock> guard(lock);
+    uint64_t i=0;
+    for (;i<n;i++) {
+        out[i]=allocate_order(0);
+        if (out[i]==0) break;
+    }
+    return i;
+}
+
+void PageBuddy::free_batch(const PhysicalAddress *pages,uint64_t n)
+{
+    for (uint64_t i=0;i<n;i++) 
+        if (pages[i]<lo || pages[i]+PageSize>hi || (pages[i]&(PageSize-1)))
+            panic("PageBuddy::free_batch of memory we don't manage: ",pages[i]);
+    lock_guard<SpinLock> guard(lock);
+    for (uint64_t i=0;i<n;i++) free_block(pages[i],0);
+}
+
+page_cpu_cache page_caches[MAX_CPUS];
+
+void print_page_cache_stats(void)
+{
+    for (int cpu=0;cpu<MAX_CPUS;cpu++) {
+        page_cpu_cache &c=page_caches[cpu];
+        if (c.hits+c.misses==0) continue;
+        print("  core "); print((int64_t)cpu); 
+        print(" page cache: hits="); print((int64_t)c.hits);
+        print(" misses="); print((int64_t)c.misses);
+        print(" drains="); print((int64_t)c.drains);
+        print(" cached="); print((int64_t)c.count); println();
+    }
+}
+
+void PageBuddy::print_stats(void)
+{
+    print("Physical pages: "); print((int64_t)(free_count*PageSize/(1024*1024)));
+    print("MB free of "); print((int64_t)(total*PageSize/(1024*1024))); println("MB");
+    print("  free blocks 4K/2M/1G: ");
+    print((int64_t)counts[0]); print("/");
+    print((int64_t)counts[9]); print("/");
+    print((int64_t)counts[BUDDY_MAX_ORDER]); println();
+}
+
+// Put this free block onto its list
+void PageBuddy::push(PhysicalAddress b,int order)
+{
+    buddy_block *n=(buddy_block *)b;
+    n->prev=0;
+    n->next=lists[order];
+    if (n->next) n->next->prev=n;
+    lists[order]=n;
+    counts[order]++;
+    free_count+=1ull<<order;
+    state_of(b)=FREE|order;
+}
+
+// Take this free block off its list
+void PageBuddy::remove(PhysicalAddress b,int order)
+{
+    buddy_block *n=(buddy_block *)b;
+    if (n->prev) n->prev->next=n->next;
+    else lists[order]=n->next;
+    if (n->next) n->next->prev=n->prev;
+    counts[order]--;
+    free_count-=1ull<<order;
+    state_of(b)=0;
+}
+
+// Return a block of exactly this order, splitting a bigger one if needed
+PhysicalAddress PageBuddy::allocate_order(int order)
+{
+    int o=order;
+    while (o<=BUDDY_MAX_ORDER && lists[o]==0) o++;
+    if (o>BUDDY_MAX_ORDER) return 0;
+
+    PhysicalAddress b=(PhysicalAddress)lists[o];
+    remove(b,o);
+    while (o>order) { // keep the low half, free the high half
+        o--;
+        push(b+block_bytes(o),o);
+    }
+    return b;
+}
+
+// Free this block, merging it with its buddy as far up as we can
+void PageBuddy::free_block(PhysicalAddress b,int order)
+{
+    while (order<BUDDY_MAX_ORDER) {
+        PhysicalAddress buddy=b^block_bytes(order);
+        if (buddy<lo || buddy+block_bytes(order)>hi) break;
+        if (state_of(buddy)!=(FREE|order)) break;
+        remove(buddy,order);
+        if (buddy<b) b=buddy;
+        order++;
+    }
+    push(b,order);
+}
+
+// Free any run of pages, as the biggest aligned blocks that fit
+void PageBuddy::free_range(PhysicalAddress base,uint64_t count)
+{
+    while (count>0) {
+        int order=0;
+        while (order<BUDDY_MAX_ORDER
+            && (base&(block_bytes(order+1)-1))==0
+            && (2ull<<order)<=count)
+            order++;
+        free_block(base,order);
+        base+=block_bytes(order);
+        count-=1ull<<order;
+    }
+}
+
+// If page p is inside a free block, return that block's start and order
+bool PageBuddy::find_free_block(PhysicalAddress p,PhysicalAddress &start,int &order)
+{
+    for (int o=0;o<=BUDDY_MAX_ORDER;o++) {
+        PhysicalAddress s=p&~(block_bytes(o)-1);
+        if (s<lo) break;
+        if (state_of(s)==(FREE|o)) { start=s; order=o; return true; }
+    }
+    return false;
+}
+
+#endif
+
+#endif
+
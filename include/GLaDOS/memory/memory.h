@@ -12,6 +12,23 @@
 //#include "memory_bump.h" //<- easy to understand
 #include "memory_region.h" //<- has "free" (sustainable)
 
+#if !GLaDOS_HOSTED
+/// Placement new: construct an object in memory we already have.
+inline void* operator new  ( uint64_t count, void *ptr ) noexcept { return ptr; }
+inline void* operator new[]  ( uint64_t count, void *ptr ) noexcept { return ptr; }
+
+/// The compiler passes this to operator new for over-aligned types,
+///   like "struct alignas(64) ...".  (Normally it's in <new>.)
+namespace std { enum class align_val_t : __SIZE_TYPE__ {}; }
+#else
+#include <new>
+#endif
+
+/// Aligned new and delete, using galloc_aligned
+void* operator new  ( uint64_t count, std::align_val_t align );
+void* operator new[]  ( uint64_t count, std::align_val_t align );
+void operator delete (void *ptr, std::align_val_t align) noexcept;
+void operator delete[] (void *ptr, std::align_val_t align) noexcept;
 
 
 #if GLaDOS_IMPLEMENT_MEMORY
@@ -34,6 +51,23 @@ void operator delete[] (void *ptr) noexcept
 {
     gfree(ptr);
 }
+
+void* operator new  ( uint64_t count, std::align_val_t align )
+{ 
+    return galloc_aligned(count,(uint64_t)align); 
+}
+void* operator new[]  ( uint64_t count, std::align_val_t align )
+{ 
+    return galloc_aligned(count,(uint64_t)align); 
+}
+void operator delete (void *ptr, std::align_val_t align) noexcept
+{
+    gfree(ptr);
+}
+void operator delete[] (void *ptr, std::align_val_t align) noexcept
+{
+    gfree(ptr);
+}
 #endif
 
 #endif
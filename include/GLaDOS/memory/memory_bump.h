@@ -7,10 +7,19 @@
 
 /// This pointer is the start of unallocated memory
 extern char *galloc_area; 
+/// This is the end of the pages galloc_area points into
+extern char *galloc_area_end;
 
 // Memory allocation.  Size is in bytes.
 inline void *galloc(uint64_t size)
 {
+    size=(size+15)&~15; // keep everything 16-byte aligned
+    if (galloc_area+size>galloc_area_end) 
+    { // grab more pages (and waste the end of the old ones)
+        uint64_t bytes=(size+LargePageSize-1)&~(LargePageSize-1);
+        galloc_area=(char *)AllocatePages(bytes/PageSize);
+        galloc_area_end=galloc_area+bytes;
+    }
     void *buffer=galloc_area;
     galloc_area+=size;
     return buffer;
@@ -24,9 +33,8 @@ inline void gfree(void *ptr)
 
 #if GLaDOS_IMPLEMENT_MEMORY /* definitions, in util.cpp */
 
-///  It's just a random address we're claiming, 
-///   hopefully it doesn't hit anything important in UEFI!
-char *galloc_area=(char *)0x10000000; 
+char *galloc_area=0; 
+char *galloc_area_end=0;
 
 
 #endif
@@ -8,56 +8,76 @@
 
 #include "GLaDOS/utility/List.h"
 
-// This is the memory address where the region allocations start.
-//  The high bits of this pointer are arbitrary, but
-//   hopefully it doesn't hit anything important in UEFI!
-const uint64_t REGION_BASE=0x4000000; 
-
-
 // This datatype stores a block's region number, 
 //  from 0 (8 bytes in size) to 63 (invalid / overflow)
 typedef unsigned int region_t;
 
-// We have a separate region for each power of two size.
-//    High region numbers will always stay zero. 
+/**
+ Each region holds blocks of one size class.  Rounding every size up to 
+ a power of two wastes up to 50% of memory, so like jemalloc and mimalloc
+ we have four classes per power of two, each 1.25x or less the last: 
+    8, 16, 24, 32,  40, 48, 56, 64,  80, 96, 112, 128,  160, 192, ...
+ This wastes at most 20% (plus rounding to 8 bytes for tiny blocks).
+ 
+ High region numbers will always stay zero. 
+*/
 enum {NUM_REGIONS=64 };
 
-// REGION_SHIFT is the number of bits in an allocated pointer
-//  before the region number starts.  
-// 2^REGION_SHIFT is the size, in bytes, of all the space available for a region
-enum { REGION_SHIFT=24 };
+// Regions grow by adding 2^CHUNK_SHIFT byte chunks of memory, as needed.
+enum { CHUNK_SHIFT=21 };
+enum { CHUNK_SIZE=1<<CHUNK_SHIFT };
 
+// This is the biggest region, with 256KB blocks (8 blocks per chunk).
+//  Anything bigger uses galloc_large.
+enum { MAX_REGION=55 };
+enum { MAX_REGION_SIZE=CHUNK_SIZE/8 };
 
-// Extract the region number from a pointer
-inline region_t region_for_pointer(void *ptr)
+/**
+ The heap directory says what every chunk of memory is used for, 
+ so gfree can find a block's region with one table lookup
+ (no block headers, no address arithmetic).  Entries are:
+   0: not galloc memory
+   r+1: a chunk of blocks from region r
+   DIRECTORY_LARGE+pages: the start of a galloc_large allocation
+*/
+enum { DIRECTORY_SIZE=(64ull<<30)>>CHUNK_SHIFT }; // covers 64GB of RAM
+enum { DIRECTORY_LARGE=0x80000000u };
+extern uint32_t galloc_directory[DIRECTORY_SIZE];
+
+// Return the directory index for this pointer
+inline uint64_t directory_index(void *ptr)
 {
-	uint64_t p=(uint64_t)ptr;
-	return (p-REGION_BASE)>>REGION_SHIFT;
+	return ((uint64_t)ptr)>>CHUNK_SHIFT;
 }
 
-// Return the pointer for the first block in this region
-inline void *pointer_for_region(region_t r)
+// Extract the region number from a pointer (>MAX_REGION if not in a region)
+inline region_t region_for_pointer(void *ptr)
 {
-	uint64_t p=(((uint64_t)r)<<REGION_SHIFT)+REGION_BASE;
-	return (void *)p;
+	uint64_t i=directory_index(ptr);
+	if (i>=DIRECTORY_SIZE) return NUM_REGIONS;
+	return galloc_directory[i]-1; //<- 0 (not galloc) wraps around to huge
 }
 
-// Compute a region number for a size, in bytes
+// Compute a region number for a size, in bytes.
+//  Sizes too big for any region give NUM_REGIONS-1, which is always empty.
 inline region_t region_for_size(uint64_t size)
 {
-	if (size<=8) return 0; //<- clz is undefined around 0
-
-	// Rationale: round up to multiple of 4,
-	//  subtract 1 to handle if it's already a power of 2,
-	//  count leading zeros (clz)
-	//  subtract from 63 (using xor)
-	else return (__builtin_clzll((size+3)/4-1)^63); 
+	if (size<=32) return size<=8?0:(size-1)/8; // 8-byte steps (size 0 counts as 8)
+	if (size>MAX_REGION_SIZE) return NUM_REGIONS-1;
+	
+	// Rationale: v=size-1 handles sizes that are already a class size.
+	//  e is the power of two below v (count leading zeros, subtract from 63),
+	//  and the next two bits below the leading 1 pick one of four classes.
+	uint64_t v=size-1;
+	region_t e=__builtin_clzll(v)^63;
+	return ((e-4)<<2) + (region_t)(v>>(e-2)) - 4;
 }
 
 // Compute this region's block size, in bytes
 inline uint64_t size_for_region(region_t r)
 {
-	return 8ull<<r;
+	if (r<4) return 8ull*(r+1);
+	return (5ull+(r&3))<<((r>>2)+2);
 }
 
 // Memory blocks not in use are stored in this linked list.
@@ -65,94 +85,575 @@ struct region_block {
 	region_block *next; // points to next entry in list, or 0 if end.
 };
 
-/// Each *thread* should store a separate free list for each region.
-extern IntrusiveList<region_block> freelist[NUM_REGIONS];
+/**
+ Free blocks are cached in "magazines": small stacks of block pointers.
+ Each core keeps two magazines per region, so almost every galloc and gfree
+ only touches our own core's magazines (no locks, no atomics).
+ Full and empty magazines get traded with the global lock-free "depot",
+ so blocks freed on another core come back in batches of MAGAZINE_SIZE.
+ Magazines design from Bonwick & Adams, "Magazines and Vmem", USENIX 2001.
+*/
+enum { MAGAZINE_SIZE=32 };
+struct galloc_magazine {
+	galloc_magazine *next; // used in the depot lists
+	uint64_t count; // number of valid rounds
+	uint64_t dirty; // number of rounds still holding old user data
+	region_block *rounds[MAGAZINE_SIZE]; // free blocks, top of stack at count-1
+	
+	inline bool full(void) const { return count>=MAGAZINE_SIZE; }
+	inline bool empty(void) const { return count==0; }
+};
+
+/**
+ With GLADOS_LAZY_ZERO, gfree doesn't scrub the block (which can be megabytes),
+ it just sets this low bit on the block's pointer in the magazine.
+ The block gets zeroed later: either by an idle core calling
+ galloc_background_zero, or by galloc right before handing it out.
+ Either way, galloc always returns zeroed memory.
+*/
+enum { DIRTY_ROUND=1 };
+
+/// Each core has one of these for each region.
+///  Only the owning core may touch it, so it needs no locks.
+struct galloc_cpu_cache {
+	galloc_magazine *loaded; // we galloc and gfree from this magazine first
+	galloc_magazine *previous; // full or empty, swapped with loaded
+	
+	// Heap statistics for this core and region.  These are only
+	//  summed across cores when somebody asks (see print_galloc_stats).
+	uint64_t allocs; // number of gallocs from this region
+	uint64_t requested; // total bytes those gallocs asked for
+	uint64_t frees; // number of gfrees to this region
+	uint64_t refills; // calls to galloc_slowpath
+	uint64_t drains; // calls to gfree_slowpath
+	int64_t flushed_live; // allocs-frees when last added to the region's live bytes
+	
+	// Bytes of memory zeroed by this core, for this region:
+	uint64_t zeroed_eager; // in gfree
+	uint64_t zeroed_lazy; // in galloc, just before use
+	uint64_t zeroed_background; // in galloc_background_zero
+};
+extern galloc_cpu_cache galloc_caches[MAX_CPUS][NUM_REGIONS];
+
+/// Return our own core's cache for this region
+inline galloc_cpu_cache &galloc_cache(region_t r) {
+	return galloc_caches[cpu_index()][r];
+}
 
-/// This is called when we need to add space to the freelist
+/// This is called when our core's magazines are empty
 void *galloc_slowpath(uint64_t size);
 
+/**
+ Allocations too big for any region come straight from contiguous
+ physical pages, aligned to LargePageSize so the hardware can map 
+ them with 2MB pages.  The page count goes in the heap directory.
+*/
+/// Allocate whole pages for this too-big-for-a-region allocation,
+///  starting at a multiple of align (LargePageSize or more).
+void *galloc_large(uint64_t size,uint64_t align=LargePageSize);
+
+/// galloc_large, without counting it in the statistics (galloc already did)
+void *galloc_large_uncounted(uint64_t size,uint64_t align);
+
+/// Free a block from galloc_large
+void gfree_large(void *ptr);
+
+/// Resize this galloc_large block in place, by giving back pages at the end
+///  or allocating the pages right after it.  Returns false if those pages are in use.
+bool galloc_large_resize(void *ptr,uint64_t size);
+
+/// This is called when our core's magazines are full
+void gfree_slowpath(void *ptr);
+
+/// Zero this many bytes, starting at this 8-byte aligned pointer.
+inline void galloc_zero(void *ptr,uint64_t bytes)
+{
+	uint64_t *p=(uint64_t *)ptr;
+	for (uint64_t i=0;i<bytes/8;i++)
+		p[i]=0ul;
+}
+
+/// Remove the top block from this (nonempty) magazine,
+///  zeroing it first if it's dirty.
+inline void *galloc_take_round(galloc_cpu_cache &c,galloc_magazine *m,region_t r)
+{
+	region_block *buffer=m->rounds[--m->count];
+#if GLADOS_LAZY_ZERO
+	if ((uint64_t)buffer & DIRTY_ROUND) 
+	{ // zero it now, before the user sees it
+		buffer=(region_block *)((uint64_t)buffer & ~(uint64_t)DIRTY_ROUND);
+		m->dirty--;
+		galloc_zero(buffer,size_for_region(r));
+		c.zeroed_lazy+=size_for_region(r);
+	}
+#endif
+	return buffer;
+}
+
 /// Inlined (fast path) memory allocation.  This works like malloc/calloc,
-/// Except: it's always zeroed memory, it's always aligned.
+/// Except: it's always zeroed memory, it's always 8-byte aligned
+///  (and power-of-two sizes are aligned to their size).
+///  Safe to call from multiple cores at once (but not from interrupt handlers).
 inline void *galloc(uint64_t size)
 {
 	region_t r=region_for_size(size);
-	region_block *buffer=freelist[r].pop(); // grab the freelist head
-	if (buffer) {
-		buffer->next=0; // whole buffer should be zeroed before user gets it
-		return buffer;
-	}
+	galloc_cpu_cache &c=galloc_cache(r);
+	c.allocs++;
+	c.requested+=size;
+	galloc_magazine *m=c.loaded;
+	if (m && !m->empty()) // grab a block from our own magazine
+		return galloc_take_round(c,m,r);
 	else 
-		return galloc_slowpath(size); //<- fills freelist, handles errors
+		return galloc_slowpath(size); //<- refills magazines, handles errors
 }
 
-// Memory deallocation.  The ptr MUST have come from galloc.
+// Memory deallocation.  The ptr MUST have come from galloc (or be 0).
 inline void gfree(void *ptr)
 {
+	if (ptr==0) return; // like free(0)
 	region_t r=region_for_pointer(ptr);
+	if (r>MAX_REGION) { gfree_large(ptr); return; } // not in any region
 	region_block *buffer=(region_block *)ptr;
+	galloc_cpu_cache &c=galloc_cache(r);
+	c.frees++;
 
-#if 1 //<- fixme: add a GLaDOS_PARANOID config option (and a config.h!)
+#if GLADOS_LAZY_ZERO
+	// Mark the block dirty, it gets scrubbed before anybody reuses it.
+	buffer=(region_block *)((uint64_t)buffer | DIRTY_ROUND);
+#else
 	// Scrub all user data from this buffer (for security)
-	//  Entry i=0 becomes buffer->next and is overwritten below.
-	uint64_t buffersize=(1ULL<<r); // size in 8-byte uint64_t's
-	for (uint64_t i=0;i<buffersize;i++)
-		((uint64_t *)buffer)[i]=0ul;
+	//  Invariant: clean blocks in magazines are all zeroed.
+	galloc_zero(buffer,size_for_region(r));
+	c.zeroed_eager+=size_for_region(r);
 #endif
 
-	// Add this buffer into our freelist
-	freelist[r].push(buffer);
+	// Add this buffer to our core's magazine
+	galloc_magazine *m=c.loaded;
+	if (m && !m->full()) {
+		m->rounds[m->count++]=buffer;
+#if GLADOS_LAZY_ZERO
+		m->dirty++;
+#endif
+	}
+	else
+		gfree_slowpath(buffer);
 }
 
+/// Allocate zeroed memory starting at a multiple of align bytes
+///  (a power of two: 16/32/64 for SIMD, PageSize for page tables and DMA).
+///  Free it with gfree as usual.
+void *galloc_aligned(uint64_t size,uint64_t align);
+
+/// Return the number of bytes that fit in this galloc'd block (0 for a 0 pointer).
+///  This is size_for_region of its region, or the page count of a large block.
+uint64_t galloc_usable_size(void *ptr);
+
+/// Zero up to this many bytes of dirty freed blocks, using 
+///  cache-bypassing stores.  Call this from an idle loop on any core.
+///  Returns the number of bytes zeroed (0 if there's nothing to do).
+uint64_t galloc_background_zero(uint64_t max_bytes);
+
+/// Print the allocator's statistics: per-region counts, live and peak bytes
+void print_galloc_stats(void);
+
+/// Print how much memory each region holds, and how much of it is wasted
+void print_galloc_fragmentation(void);
+
 
 
 
 #if GLaDOS_IMPLEMENT_MEMORY /* definitions, in util.cpp */
 
+/// Each core's magazines, for each region.
+galloc_cpu_cache galloc_caches[MAX_CPUS][NUM_REGIONS];
+
+void galloc_zero_nontemporal(void *ptr,uint64_t bytes);
+
+/// The depot: magazines that aren't loaded on any core.
+LockFreeList<galloc_magazine> depot_full[NUM_REGIONS]; // full of zeroed free blocks
+LockFreeList<galloc_magazine> depot_dirty[NUM_REGIONS]; // full, some blocks need zeroing
+LockFreeList<galloc_magazine> depot_empty; // empty magazines (any region)
+
+/// The heap directory, indexed by address/CHUNK_SIZE
+uint32_t galloc_directory[DIRECTORY_SIZE];
+
+/// Each region grows by carving blocks out of its current chunk.
+struct galloc_region {
+	SpinLock lock; // protects the fields below
+	char *chunk; // chunk we're carving blocks from (or 0)
+	uint64_t carved; // bytes of chunk handed out so far
+	uint64_t chunks; // total number of chunks this region has used
+	
+	// Bytes allocated and not yet freed, updated atomically by each core's
+	//  slow path, so these lag the true values by a few magazines.
+	int64_t live; // bytes in use now
+	int64_t peak; // high-water mark of live
+};
+galloc_region galloc_regions[NUM_REGIONS]; //<- NUM_REGIONS-1 has galloc_large stats
+
+/// Live and peak bytes for the whole heap (all regions and galloc_large)
+int64_t galloc_heap_live, galloc_heap_peak;
 
-/// Each *thread* should store a separate free list for each region.
-IntrusiveList<region_block> freelist[NUM_REGIONS];
+/// Atomically raise *peak to at least value
+void galloc_atomic_max(int64_t *peak,int64_t value)
+{
+	int64_t old=__atomic_load_n(peak,__ATOMIC_RELAXED);
+	while (old<value && !__atomic_compare_exchange_n(peak,&old,value,
+		true,__ATOMIC_RELAXED,__ATOMIC_RELAXED)) {}
+}
+
+/// Add this many bytes to region r's live bytes (and the heap's), updating peaks.
+void galloc_add_live(region_t r,int64_t bytes)
+{
+	galloc_region &g=galloc_regions[r];
+	galloc_atomic_max(&g.peak,__atomic_add_fetch(&g.live,bytes,__ATOMIC_RELAXED));
+	galloc_atomic_max(&galloc_heap_peak,__atomic_add_fetch(&galloc_heap_live,bytes,__ATOMIC_RELAXED));
+}
+
+/// Publish this core's allocs and frees since last time to region r's live bytes.
+///  Called from the slow paths, so it's only once per magazine.
+void galloc_flush_stats(galloc_cpu_cache &c,region_t r)
+{
+	int64_t live=(int64_t)(c.allocs-c.frees);
+	int64_t delta=live-c.flushed_live;
+	if (delta==0) return;
+	c.flushed_live=live;
+	galloc_add_live(r,delta*(int64_t)size_for_region(r));
+}
+
+/// Magazines get carved out of their own chunks, like a region.
+enum { MAGAZINE_REGION=MAX_REGION+1 };
 
+/// Get a fresh zeroed chunk of memory for region r.
+///  Caller must hold the region's lock.
+char *galloc_new_chunk(region_t r)
+{
+	galloc_region &g=galloc_regions[r];
+	if (g.chunks==0) {
+		print("galloc: Initializing buffers for region ");
+		print((int)r);
+		println();
+	}
+	
+	// From the PageBuddy, not UEFI, so any core can grow a region
+	char *chunk=(char *)AllocatePages(CHUNK_SIZE/PageSize,CHUNK_SIZE);
+	uint64_t i=directory_index(chunk);
+	if (i>=DIRECTORY_SIZE) panic("galloc chunk is beyond DIRECTORY_SIZE: ",(uint64_t)chunk);
+	
+	//  Invariant: clean buffers in magazines are all zeroed
+	galloc_zero_nontemporal(chunk,CHUNK_SIZE);
+	galloc_cache(r).zeroed_lazy+=CHUNK_SIZE;
+	
+	__atomic_store_n(&galloc_directory[i],r+1,__ATOMIC_RELEASE);
+	g.chunks++;
+	return chunk;
+}
 
-/// This is called when we need to add space to the freelist
+/// Carve up to n never-used blocks of this size from region r,
+///   and store them in out.  Returns the number of blocks carved.
+uint64_t galloc_carve(region_t r,uint64_t size,uint64_t n,region_block **out)
+{
+	galloc_region &g=galloc_regions[r];
+	lock_guard<SpinLock> guard(g.lock);
+	
+	if (g.chunk==0 || g.carved+size>CHUNK_SIZE) 
+	{ // Current chunk is used up, add another chunk
+		g.chunk=galloc_new_chunk(r);
+		g.carved=0;
+	}
+	
+	uint64_t count=0;
+	while (count<n && g.carved+size<=CHUNK_SIZE) {
+		out[count++]=(region_block *)(g.chunk+g.carved);
+		g.carved+=size;
+	}
+	return count;
+}
+
+/// Return an empty magazine, making a new one if needed.
+galloc_magazine *galloc_empty_magazine(void)
+{
+	galloc_magazine *m=depot_empty.pop();
+	if (m) return m;
+	
+	galloc_carve(MAGAZINE_REGION,sizeof(galloc_magazine),1,(region_block **)&m);
+	m->next=0;
+	m->count=0;
+	m->dirty=0;
+	return m;
+}
+
+/// Fill this empty magazine with never-used blocks from region r.
+void galloc_carve_magazine(galloc_magazine *m,region_t r)
+{
+	m->count=galloc_carve(r,size_for_region(r),MAGAZINE_SIZE,m->rounds);
+}
+
+/// This is called when our core's magazines are empty
 void *galloc_slowpath(uint64_t size)
 {
 	region_t r=region_for_size(size);
-	if (r<0||r>REGION_SHIFT) {
-		// Allocation too big--FIXME: fall back to page table here?
-		panic("Allocation too big for galloc:",size);
+	if (r>MAX_REGION) // Allocation too big for a region (galloc counted it)
+		return galloc_large_uncounted(size,LargePageSize);
+	galloc_cpu_cache &c=galloc_cache(r);
+	c.refills++;
+	galloc_flush_stats(c,r);
+	
+	if (c.previous && !c.previous->empty()) 
+	{ // previous is full: swap it in
+		galloc_magazine *t=c.loaded; c.loaded=c.previous; c.previous=t;
 	}
+	else 
+	{ // Both our magazines are empty: trade for a full one from the depot
+		galloc_magazine *full=depot_full[r].pop();
+		if (!full) full=depot_dirty[r].pop(); //<- galloc_take_round zeroes these
+		if (!full) {
+			full=galloc_empty_magazine();
+			galloc_carve_magazine(full,r);
+		}
+		if (c.previous) depot_empty.push(c.previous);
+		c.previous=c.loaded;
+		c.loaded=full;
+	}
+	return galloc_take_round(c,c.loaded,r);
+}
+
+void *galloc_large(uint64_t size,uint64_t align)
+{
+	galloc_cpu_cache &c=galloc_cache(NUM_REGIONS-1);
+	c.allocs++;
+	c.requested+=size;
+	return galloc_large_uncounted(size,align);
+}
+
+void *galloc_large_uncounted(uint64_t size,uint64_t align)
+{
+	uint64_t pages=(size+PageSize-1)/PageSize;
+	if (align<LargePageSize) align=LargePageSize; //<- gfree_large needs this
+	void *ptr=(void *)AllocatePages(pages,align);
+	uint64_t i=directory_index(ptr);
+	if (i>=DIRECTORY_SIZE || pages>=DIRECTORY_LARGE) 
+		panic("galloc_large: pages beyond DIRECTORY_SIZE at ",(uint64_t)ptr);
+	galloc_directory[i]=DIRECTORY_LARGE+pages;
+	galloc_add_live(NUM_REGIONS-1,pages*PageSize);
 	
-	// Allocate some memory
-	//  FIXME: check if we've already allocated too much and are hitting the next region
-	//  FIXME: direct page table alloc here?  Multicore locking / buffer stealing here?
-	void *base=pointer_for_region(r);
-	uint64_t buffersize=size_for_region(r); // size of buffers to allocate
-	enum {n_bytes=1<<REGION_SHIFT}; // allocate this many bytes per mmap call
-	
-	// Split the new space into buffers, and link into the free list.
-	//  Invariant: buffers in the free list are all zeroed
-	uint64_t nbuffers=n_bytes/buffersize;
-	//printf("galloc: Initializing %d buffers starting at %p for region %d\n",
-	//	(int)nbuffers,base,(int)r);
-	print("galloc: Initializing buffers for region ");
-	print((int)r);
-	print(" from pointer ");
-	print((uint64_t)base);
-	println();
+	// Fresh pages aren't zeroed, but galloc promises zeroed memory
+	galloc_zero_nontemporal(ptr,pages*PageSize);
+	galloc_cache(0).zeroed_lazy+=pages*PageSize;
+	return ptr;
+}
+
+/// Return the page count of this galloc_large block (or panic if it isn't one)
+uint64_t galloc_large_pages(void *ptr)
+{
+	uint64_t i=directory_index(ptr);
+	uint32_t entry=0;
+	if (i<DIRECTORY_SIZE && ((uint64_t)ptr%LargePageSize)==0)
+		entry=galloc_directory[i];
+	if (entry<=DIRECTORY_LARGE) panic("Pointer not from galloc: ",(uint64_t)ptr);
+	return entry-DIRECTORY_LARGE;
+}
+
+void gfree_large(void *ptr)
+{
+	uint64_t pages=galloc_large_pages(ptr);
+	galloc_directory[directory_index(ptr)]=0;
+	galloc_cache(NUM_REGIONS-1).frees++;
+	galloc_add_live(NUM_REGIONS-1,-(int64_t)(pages*PageSize));
+	DeallocatePages((PhysicalAddress)ptr,pages);
+}
+
+bool galloc_large_resize(void *ptr,uint64_t size)
+{
+	uint64_t old_pages=galloc_large_pages(ptr);
+	uint64_t pages=(size+PageSize-1)/PageSize;
+	if (pages==0 || pages>=DIRECTORY_LARGE) return false;
 	
-	for (int b=nbuffers-1;b>=0;b--)
+	char *end=(char *)ptr+old_pages*PageSize;
+	if (pages<old_pages) // shrink: give back the tail pages
+		DeallocatePages((PhysicalAddress)ptr+pages*PageSize,old_pages-pages);
+	else if (pages>old_pages) 
+	{ // grow: claim the pages right after us, if they're free
+		if (!AllocatePagesAt((PhysicalAddress)end,pages-old_pages)) return false;
+		galloc_zero_nontemporal(end,(pages-old_pages)*PageSize);
+		galloc_cache(0).zeroed_lazy+=(pages-old_pages)*PageSize;
+	}
+	
+	galloc_directory[directory_index(ptr)]=DIRECTORY_LARGE+pages;
+	galloc_add_live(NUM_REGIONS-1,((int64_t)pages-(int64_t)old_pages)*PageSize);
+	return true;
+}
+
+void *galloc_aligned(uint64_t size,uint64_t align)
+{
+	if (align==0 || (align&(align-1))!=0) 
+		panic("galloc_aligned alignment must be a power of two: ",align);
+	
+	// Chunks are CHUNK_SIZE aligned, so every block in a region is aligned 
+	//  to the biggest power of two dividing its block size.
+	//  Use the first region big enough that's a multiple of align.
+	for (region_t r=region_for_size(size);r<=MAX_REGION;r++)
+		if (size_for_region(r)%align==0) {
+			void *ptr=galloc(size_for_region(r));
+			// Book what the caller asked for, so the rounding shows as waste
+			galloc_cache(r).requested-=size_for_region(r)-size;
+			return ptr;
+		}
+	
+	return galloc_large(size,align);
+}
+
+uint64_t galloc_usable_size(void *ptr)
+{
+	if (ptr==0) return 0;
+	region_t r=region_for_pointer(ptr);
+	if (r<=MAX_REGION) return size_for_region(r);
+	else return galloc_large_pages(ptr)*PageSize;
+}
+
+/// Put this full magazine back in the depot
+void galloc_depot_push(galloc_magazine *m,region_t r)
+{
+	if (m->dirty) depot_dirty[r].push(m);
+	else depot_full[r].push(m);
+}
+
+/// This is called when our core's magazines are full.
+///  ptr may have the DIRTY_ROUND bit set.
+void gfree_slowpath(void *ptr)
+{
+	region_t r=region_for_pointer((void *)((uint64_t)ptr & ~(uint64_t)DIRTY_ROUND));
+	galloc_cpu_cache &c=galloc_cache(r);
+	c.drains++;
+	galloc_flush_stats(c,r);
+	
+	if (c.previous && c.previous->empty())
+	{ // previous is empty: swap it in
+		galloc_magazine *t=c.loaded; c.loaded=c.previous; c.previous=t;
+	}
+	else
+	{ // Both our magazines are full (or missing): hand one back to the depot
+		if (c.previous) galloc_depot_push(c.previous,r);
+		c.previous=c.loaded;
+		c.loaded=galloc_empty_magazine();
+	}
+	c.loaded->rounds[c.loaded->count++]=(region_block *)ptr;
+	if ((uint64_t)ptr & DIRTY_ROUND) c.loaded->dirty++;
+}
+
+/// Zero this block with non-temporal (cache-bypassing) stores,
+///  so scrubbing big blocks doesn't flush everything else out of cache.
+void galloc_zero_nontemporal(void *ptr,uint64_t bytes)
+{
+	uint64_t *p=(uint64_t *)ptr;
+	uint64_t zero=0;
+	for (uint64_t i=0;i<bytes/8;i++)
+		__asm__ __volatile__("movnti %1,%0" : "=m"(p[i]) : "r"(zero));
+	__asm__ __volatile__("sfence" ::: "memory"); // make the stores visible
+}
+
+uint64_t galloc_background_zero(uint64_t max_bytes)
+{
+	uint64_t total=0;
+	for (region_t r=0;r<=MAX_REGION && total<max_bytes;r++)
 	{
-		char *start=((char *)base)+b*buffersize;
-		region_block *buffer=(region_block *)start;
-		if (b==0) {
-		    return buffer; //<- return the last buffer to the user
+		galloc_magazine *m;
+		while (total<max_bytes && 0!=(m=depot_dirty[r].pop()))
+		{ // We own this magazine now, scrub all its dirty blocks
+			uint64_t bytes=size_for_region(r), scrubbed=0;
+			for (uint64_t i=0;i<m->count;i++) {
+				uint64_t b=(uint64_t)m->rounds[i];
+				if (b & DIRTY_ROUND) {
+					b&=~(uint64_t)DIRTY_ROUND;
+					galloc_zero_nontemporal((void *)b,bytes);
+					m->rounds[i]=(region_block *)b;
+					scrubbed+=bytes;
+				}
+			}
+			m->dirty=0;
+			depot_full[r].push(m);
+			galloc_cache(r).zeroed_background+=scrubbed;
+			total+=scrubbed;
 		}
-		// Add to our freelist
-		freelist[r].push(buffer);
 	}
-	return 0; //<- never reached, we return at b==0 (but gcc whines)
+	return total;
 }
 
-#endif
+/// Print the allocator's statistics, summed across all cores
+void print_galloc_stats(void)
+{
+	println("galloc size: allocs frees live(KB) peak(KB) refills drains");
+	uint64_t eager=0, lazy=0, background=0;
+	int64_t total_live=0;
+	for (region_t r=0;r<NUM_REGIONS;r++)
+	{
+		galloc_cpu_cache sum={0};
+		for (int cpu=0;cpu<MAX_CPUS;cpu++) {
+			const galloc_cpu_cache &c=galloc_caches[cpu][r];
+			sum.allocs+=c.allocs;
+			sum.frees+=c.frees;
+			sum.refills+=c.refills;
+			sum.drains+=c.drains;
+			eager+=c.zeroed_eager;
+			lazy+=c.zeroed_lazy;
+			background+=c.zeroed_background;
+		}
+		if (sum.allocs==0 || (r>MAX_REGION && r<NUM_REGIONS-1)) continue;
+		
+		// Per-core counters are exact, but live/peak lag by a few magazines
+		int64_t live=(int64_t)(sum.allocs-sum.frees);
+		if (r<=MAX_REGION) live*=size_for_region(r);
+		else live=galloc_regions[r].live; // galloc_large
+		total_live+=live;
+		
+		if (r<=MAX_REGION) { print("  "); print((int64_t)size_for_region(r)); }
+		else print("  large");
+		print(": "); print((int64_t)sum.allocs);
+		print(" "); print((int64_t)sum.frees);
+		print(" "); print(live>>10);
+		print(" "); print(galloc_regions[r].peak>>10);
+		print(" "); print((int64_t)sum.refills);
+		print(" "); print((int64_t)sum.drains);
+		println();
+	}
+	print("galloc heap: live="); print(total_live>>10);
+	print("KB peak="); print(galloc_heap_peak>>10);
+	println("KB");
+	print("galloc zeroing (bytes): eager in gfree="); print((int64_t)eager);
+	print(" lazy in galloc="); print((int64_t)lazy);
+	print(" background="); print((int64_t)background);
+	println();
+}
 
+/// Print each region's chunks and size-class rounding waste, summed across cores
+void print_galloc_fragmentation(void)
+{
+	println("galloc regions: size, chunks, allocs, waste from rounding up");
+	uint64_t held=0, requested=0, granted=0;
+	for (region_t r=0;r<=MAX_REGION;r++)
+	{
+		uint64_t allocs=0, asked=0;
+		for (int cpu=0;cpu<MAX_CPUS;cpu++) {
+			allocs+=galloc_caches[cpu][r].allocs;
+			asked+=galloc_caches[cpu][r].requested;
+		}
+		uint64_t chunks=galloc_regions[r].chunks;
+		if (chunks==0 && allocs==0) continue;
+		uint64_t got=allocs*size_for_region(r);
+		
+		print("  "); print((int64_t)size_for_region(r));
+		print(" bytes: "); print((int64_t)chunks);
+		print(" chunks, "); print((int64_t)allocs);
+		print(" allocs, "); print((int64_t)(got?100*(got-asked)/got:0));
+		println("% waste");
+		
+		held+=chunks*CHUNK_SIZE;
+		requested+=asked;
+		granted+=got;
+	}
+	print("galloc total: "); print((int64_t)(held>>10));
+	print(" KB in region chunks, "); print((int64_t)(granted?100*(granted-requested)/granted:0));
+	println("% of allocated bytes wasted by size classes");
+}
 
+#endif
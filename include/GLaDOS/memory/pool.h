@@ -0,0 +1,121 @@
+/*
+  Typed object pools ("slab caches") for kernel objects.
+
+  Every object in a pool has the same type, so they pack densely
+  into slabs, each object starts on an ALIGN-byte boundary (a cache
+  line by default, so two cores never fight over one line), and
+  allocate and deallocate are just a linked list pop and push.
+  Slab allocator design from Bonwick, "The Slab Allocator", USENIX 1994.
+
+  Group Led and Designed Operating System (GLaDOS)
+  A UEFI-based C++ operating system.
+
+  Dr. Orion Lawlor and the UAF CS 321 class, 2021-03 (Public Domain)
+*/
+#ifndef __GLADOS_MEMORY_POOL_H
+#define __GLADOS_MEMORY_POOL_H
+
+/// Pools get memory from galloc_aligned in slabs this big
+enum { POOL_SLAB=64*1024 };
+
+/// A free object sitting in a pool
+struct pool_slot {
+    pool_slot *next;
+};
+
+/**
+ Holds objects of type T, each aligned to ALIGN bytes (a power of two).
+ The pool only ever grows, so object addresses stay predictable.
+
+ Objects come back from allocate exactly as they were deallocated,
+ except the first 8 bytes are zeroed.  So a type whose "constructed"
+ state is all zeros (like a page of page-table entries) can skip
+ initializing if it's always deallocated in that state.
+ Brand new objects come from galloc, so they're all zeros.
+
+ Thread safety: any core can allocate and deallocate at once.
+*/
+template <class T, uint64_t ALIGN=64>
+class ObjectPool {
+public:
+    /// Bytes per object, rounded up to a multiple of ALIGN.
+    ///  (A function, so T can still be incomplete when we're declared.)
+    static constexpr uint64_t slot_size(void) { return (sizeof(T)+ALIGN-1)&~(ALIGN-1); }
+
+    ObjectPool() { free=0; slab=0; carved=0; slabs=0; in_use=0; }
+
+    /// Get memory for one T (not constructed!)
+    T *allocate(void) {
+        lock_guard<SpinLock> guard(lock);
+        pool_slot *s=free;
+        if (s) free=s->next;
+        else s=carve();
+        s->next=0; //<- put back the zeros the free list used
+        in_use++;
+        return (T *)s;
+    }
+
+    /// Give this T's memory back to the pool (it must already be destructed).
+    void deallocate(T *ptr) {
+        lock_guard<SpinLock> guard(lock);
+        pool_slot *s=(pool_slot *)ptr;
+        s->next=free;
+        free=s;
+        in_use--;
+    }
+
+    /// Number of objects allocated and not yet deallocated
+    uint64_t count_in_use(void) const { return in_use; }
+    /// Bytes of slabs this pool holds
+    uint64_t bytes_held(void) const { return slabs*POOL_SLAB; }
+
+private:
+    SpinLock lock; // protects everything below
+    pool_slot *free; // linked list of objects ready to allocate
+    char *slab; // slab we're carving new objects from (or 0)
+    uint64_t carved; // bytes of slab handed out so far
+    uint64_t slabs; // number of slabs allocated
+    uint64_t in_use; // objects allocated and not deallocated
+
+    /// Free list is empty: carve a new object out of our slab.
+    pool_slot *carve(void) {
+        static_assert(slot_size()*4<=POOL_SLAB, "ObjectPool type too big for a slab");
+        static_assert(ALIGN>=sizeof(pool_slot) && (ALIGN&(ALIGN-1))==0, "ObjectPool ALIGN must be a power of two");
+        if (slab==0 || carved+slot_size()>POOL_SLAB) {
+            slab=(char *)galloc_aligned(POOL_SLAB,ALIGN);
+            carved=0;
+            slabs++;
+        }
+        pool_slot *s=(pool_slot *)(slab+carved);
+        carved+=slot_size();
+        return s;
+    }
+};
+
+
+/**
+ Inherit from this to make "new T" and "delete" use an ObjectPool:
+    class Window : public Pooled<Window> { ... };
+ Derived classes of a different size still use galloc.
+*/
+template <class T, uint64_t ALIGN=64>
+class Pooled {
+public:
+    static void *operator new(uint64_t size) {
+        if (size!=sizeof(T)) return galloc(size);
+        return pool.allocate();
+    }
+    static void operator delete(void *ptr,uint64_t size) {
+        if (size!=sizeof(T)) gfree(ptr);
+        else pool.deallocate((T *)ptr);
+    }
+
+    /// All the T objects live here
+    static ObjectPool<T,ALIGN> pool;
+};
+
+template <class T, uint64_t ALIGN>
+ObjectPool<T,ALIGN> Pooled<T,ALIGN>::pool;
+
+#endif
+
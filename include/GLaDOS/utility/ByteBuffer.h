@@ -70,16 +70,34 @@ public:
     ///  Returns the number of objects that actually fit.
     template <typename T>
     uint64_t Fill(const T &object, uint64_t numberOfObjects=LLONG_MAX){
-        uint64_t Tlength = length - (length % (sizeof(T)));
-        uint64_t reqLength=numberOfObjects*sizeof(T);
-        uint64_t fillLength=std::min(Tlength,reqLength);        
-    
-        //fill the buffer with the objects
-        uint64_t i;
-        for(i = 0; i<fillLength; i+=sizeof(T)) {
-            *(T *)(start + i) = object;
+        uint64_t count=length/sizeof(T);
+        if (numberOfObjects<count) count=numberOfObjects;
+        uint64_t fillLength=count*sizeof(T);
+        if (fillLength==0) return 0;
+        
+        if (sizeof(T)==1) { // bytes: memset does it all
+            __builtin_memset(start,*(const Byte *)&object,fillLength);
+        }
+        else { // write one object, then keep doubling the filled part with memcpy
+            __builtin_memcpy(start,&object,sizeof(T));
+            uint64_t done=sizeof(T);
+            while (done<fillLength) {
+                uint64_t n=fillLength-done;
+                if (n>done) n=done;
+                __builtin_memcpy(start+done,start,n);
+                done+=n;
+            }
         }
-        return i/sizeof(T);
+        return count;
+    }
+    
+    /// Copy bytes from src into the start of this buffer (they may overlap).
+    ///  Returns the number of bytes copied, the smaller of the two lengths.
+    uint64_t CopyFrom(const ByteBuffer &src) {
+        uint64_t n=src.getLength();
+        if (n>length) n=length;
+        __builtin_memmove(start,src.begin(),n);
+        return n;
     }
     
 // FIXME: Add more utility functions here!
@@ -106,6 +124,12 @@ public:
     
     T *begin() const { return (T *)start; }
     T *end() const { return ((T *)start) + length/sizeof(T); }
+    
+    /// Number of T's in this array
+    uint64_t size() const { return length/sizeof(T); }
+    
+    /// Set every T in this array to this value
+    uint64_t Fill(const T &value) { return ByteBuffer::Fill(value); }
 };
 
 
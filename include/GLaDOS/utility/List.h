@@ -94,5 +94,64 @@ private:
 };
 
 
+/**
+ Like IntrusiveList, but any number of threads can push and pop at once.
+ This is a lock-free "Treiber stack": the head pointer is swapped with
+ an atomic compare-and-swap.  The high 16 bits of the head count changes,
+ so a node that gets popped and pushed back in between our read and our
+ CAS doesn't fool us (the "ABA problem").
+
+ CAUTION: pop reads head->next from a node another thread may have just
+ popped, so nodes must never be handed back to anybody but another list.
+*/
+template <class NODE>
+class LockFreeList {
+protected:
+	/// Low 48 bits: first NODE in the list (or 0).  High 16 bits: change count.
+	uint64_t head;
+
+	enum {POINTER_BITS=48};
+	static inline NODE *pointer(uint64_t h) { return (NODE *)(h&((1ull<<POINTER_BITS)-1)); }
+	static inline uint64_t next_tag(uint64_t h,NODE *p) {
+		return (((h>>POINTER_BITS)+1)<<POINTER_BITS) | (uint64_t)p;
+	}
+public:
+	inline LockFreeList() { head=0; }
+
+	/// Add this node as the beginning of our list.  Thread safe.
+	inline void push(NODE *cur) {
+		uint64_t old=__atomic_load_n(&head,__ATOMIC_RELAXED);
+		do {
+			cur->next=pointer(old);
+		} while (!__atomic_compare_exchange_n(&head,&old,next_tag(old,cur),
+				true,__ATOMIC_RELEASE,__ATOMIC_RELAXED));
+	}
+
+	/// Return true if this list contains no nodes (might change right away!)
+	inline bool empty(void) const {
+		return pointer(__atomic_load_n(&head,__ATOMIC_RELAXED))==0;
+	}
+
+	/// If this list is empty, return 0.
+	/// Otherwise remove and return the first thing in the list.  Thread safe.
+	inline NODE *pop(void) {
+		uint64_t old=__atomic_load_n(&head,__ATOMIC_ACQUIRE);
+		while (true) {
+			NODE *cur=pointer(old);
+			if (cur==0) return 0;
+			NODE *next=cur->next;
+			if (__atomic_compare_exchange_n(&head,&old,next_tag(old,next),
+					true,__ATOMIC_ACQUIRE,__ATOMIC_ACQUIRE))
+				return cur;
+		}
+	}
+
+private:
+	// Don't try to copy or assign this class
+	LockFreeList(const LockFreeList &copy) = delete;
+	void operator=(const LockFreeList &copy) = delete;
+};
+
+
 #endif
 
@@ -0,0 +1,40 @@
+/*
+  Locks for code that runs on several cores at once.
+
+  Group Led and Designed Operating System (GLaDOS)
+  A UEFI-based C++ operating system.
+
+  Dr. Orion Lawlor and the UAF CS 321 class, 2021-03 (Public Domain)
+*/
+#ifndef __GLADOS_UTILITY_LOCK_H
+#define __GLADOS_UTILITY_LOCK_H
+
+/// A working spinlock: the atomic exchange means only one core
+///  can see locked go from 0 to 1.  Keep critical sections short!
+class SpinLock {
+public:
+    volatile int locked; // 0: unlocked.  1: locked
+    SpinLock() { locked=0; }
+    void lock(void) {
+        while (__atomic_exchange_n(&locked,1,__ATOMIC_ACQUIRE)!=0)
+            while (locked!=0) __builtin_ia32_pause(); // wait without hammering the bus
+    }
+    /// Take the lock if nobody has it, and return true if we got it
+    bool try_lock(void) {
+        return __atomic_exchange_n(&locked,1,__ATOMIC_ACQUIRE)==0;
+    }
+    void unlock(void) {
+        __atomic_store_n(&locked,0,__ATOMIC_RELEASE);
+    }
+};
+
+/// Lock on creation, unlock on destruction.
+template <class Mutex>
+class lock_guard {
+public:
+    Mutex &l;
+    lock_guard(Mutex &l_) :l(l_) { l.lock(); }
+    ~lock_guard() { l.unlock(); }
+};
+
+#endif
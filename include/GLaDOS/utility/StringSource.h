@@ -202,6 +202,16 @@ public:
     // Read file data (block by block)
     bool get(ByteBuffer &buf,int index) const;
     
+    /// Read bytes starting at this file offset straight into dest, in one Read.
+    ///  Returns the number of bytes read (fewer at the end of the file).
+    uint64_t read(uint64_t offset,void *dest,uint64_t bytes) const;
+    
+    /// Look up the file's size in bytes, and when it was last modified.
+    void stat(uint64_t &size,EFI_TIME &modified) const;
+    
+    /// Close the file (don't read from it after this).
+    void close(void);
+    
     enum {BLOCK_SIZE=4096}; // I/O buffer size
 private:
     EFI_FILE_PROTOCOL* file; // opened file (EFI)
@@ -11,7 +11,17 @@
 #define __GLADOS_UTILITY_VECTOR_H
 
 
-template <class T>
+/// vector's default allocation policy: plain new[] and delete[]
+struct NewAllocator {
+    template <class T>
+    static T *allocate(uint64_t n) { return new T[n]; }
+    
+    template <class T>
+    static void deallocate(T *p,uint64_t n) { delete[] p; }
+};
+
+/// Alloc is an allocation policy like NewAllocator (or ArenaAllocator)
+template <class T, class Alloc=NewAllocator>
 class vector {
 public:
     // Handy typedefs, hat tip to libstdc++
@@ -31,7 +41,7 @@ public:
     void operator=(const vector &v) =delete;
     
     /// But move construction is OK:
-    vector(vector<T> && doomed) {
+    vector(vector && doomed) {
         start=doomed.start;
         finish=doomed.finish;
         end_of_storage=doomed.end_of_storage;
@@ -41,7 +51,7 @@ public:
     
     /// Deallocate memory on destruction
     ~vector() {
-        if (start) delete[] start;
+        if (start) Alloc::deallocate(start,capacity());
         start=finish=end_of_storage=(pointer)0xd;
     }
     
@@ -94,7 +104,7 @@ public:
         size_t new_bytes=8; // size in bytes
         while ((size()+1)*sizeof(T)>new_bytes) new_bytes*=2;
         size_t new_elements=new_bytes/sizeof(T);
-        pointer nu=new T[new_elements];
+        pointer nu=Alloc::template allocate<T>(new_elements);
         
         // Copy old to new elements
         // FIXME: figure out fancy placement new here, to avoid copying T's
@@ -104,10 +114,11 @@ public:
             nu[index]=start[index];
         
         pointer old=start;
+        size_type old_elements=capacity();
         start=nu;
         finish=&nu[limit];
         end_of_storage=&nu[new_elements];
-        delete[] old;
+        if (old) Alloc::deallocate(old,old_elements);
     }
 
 private:
@@ -37,6 +37,7 @@ extern const char* LODEPNG_VERSION_STRING;
 #define LODEPNG_NO_COMPILE_ERROR_TEXT
 #define LODEPNG_NO_COMPILE_DISK
 #define LODEPNG_NO_COMPILE_CPP
+#define LODEPNG_NO_COMPILE_ALLOCATORS /* ours are in graphics.cpp, and use the current Arena */
 
 /*
 The following #defines are used to create code sections. They can be disabled
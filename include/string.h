@@ -7,6 +7,9 @@ extern "C" {
     typedef unsigned long long size_t;
     
     void *memcpy(void *dest, const void *src, size_t n);
+    void *memmove(void *dest, const void *src, size_t n);
+    void *memset(void *dest, int value, size_t n);
+    int memcmp(const void *a, const void *b, size_t n);
     
     int strcmp(const char *s1, const char *s2);
     int strncmp(const char *s1, const char *s2, size_t n);
@@ -101,6 +101,10 @@ enum {
   keycode_esc=-23
 };
 
+/// Bytes of freed memory to zero per idle loop iteration
+///  (small, so we still respond to keys quickly)
+enum {idle_zero_bytes=256*1024};
+
 /*
  Return the read-in char, as Unicode (if possible).
 */
@@ -108,7 +112,9 @@ int read_char(void) {
   EFI_STATUS status;
   EFI_INPUT_KEY k;
   do {
-    pause_CPU();
+    // While we're idle, scrub some freed memory
+    if (galloc_background_zero(idle_zero_bytes)==0)
+      pause_CPU();
     status = ST->ConIn->ReadKeyStroke(ST->ConIn, &k);
   } while (status==EFI_NOT_READY);
   if (k.UnicodeChar) {
@@ -170,12 +176,38 @@ bool FileDataStringSource::get(ByteBuffer &buf,int index) const
     UINTN size=BLOCK_SIZE;
     UEFI_CHECK(file->SetPosition(file,BLOCK_SIZE*index));
     UEFI_CHECK(file->Read(file,&size,block));
-    print(size); println(" bytes read from file in file.get");
     if (size==0) return false; // no file data
     buf=ByteBuffer(block,size);
     return true;
 }
 
+uint64_t FileDataStringSource::read(uint64_t offset,void *dest,uint64_t bytes) const
+{
+    UINTN size=bytes;
+    UEFI_CHECK(file->SetPosition(file,offset));
+    UEFI_CHECK(file->Read(file,&size,dest));
+    return size;
+}
+
+void FileDataStringSource::stat(uint64_t &size,EFI_TIME &modified) const
+{
+    EFI_GUID info_guid=EFI_FILE_INFO_ID;
+    struct {
+        EFI_FILE_INFO info;
+        CHAR16 name[256]; // space for the variable-length FileName
+    } buf;
+    UINTN bytes=sizeof(buf);
+    UEFI_CHECK(file->GetInfo(file,&info_guid,&bytes,&buf.info));
+    size=buf.info.FileSize;
+    modified=buf.info.ModificationTime;
+}
+
+void FileDataStringSource::close(void)
+{
+    if (file) UEFI_CHECK(file->Close(file));
+    file=0;
+}
+
 /// Run a "goofy one-char command"
 void handle_command(char cmd)
 {
@@ -190,6 +222,12 @@ void handle_command(char cmd)
     else if (cmd=='L') { // run a linux C program
       run_linux("APPS/prog_c");
     }
+    else if (cmd=='b') { // time the syscall path
+      benchmark_syscalls();
+    }
+    else if (cmd=='S') { // print the syscall trace, and turn tracing on or off
+      toggle_syscall_trace();
+    }
     else if (cmd=='i') { // dump the interrupt descriptor table (IDT)
       print_idt();
     }
@@ -251,6 +289,11 @@ void handle_command(char cmd)
     else if (cmd=='f') { // file read
         println("File contents: "+FileContents("APPS/DATA.DAT"));
     }
+    else if (cmd=='M') { // memory allocator stats
+      print_galloc_stats();
+      print_memory_functions();
+      print_TLB_stats();
+    }
     else if (cmd=='m') { // dump memory map
       println("Fetching memory map");
       enum {n=128};
@@ -287,6 +330,9 @@ void handle_command(char cmd)
         }
       }
       
+      physical_pages.print_stats();
+      print_page_cache_stats();
+      print_galloc_fragmentation();
     }
     else {
       println("Unknown command.");
@@ -5,92 +5,494 @@ Dr. Orion Lawlor and CS 321 class, 2021-02 (Public Domain)
 */
 #include "GLaDOS/GLaDOS.h"
 #include "elf.h"
+#include "string.h"
 
 // From asm_util.s:
 typedef long (*function_t)(void);
+/// Run user code f in ring 3 with this stack, until it exits
 extern "C" uint64_t start_function_with_stack(function_t f,uint64_t *stack);
 extern "C" void return_to_main_stack(void);
 
 extern "C" uint64_t syscall_setup(); 
 extern "C" void syscall_finish(); 
 
+/// The user's registers, as saved by syscall_entry (in util_asm.s)
+struct SyscallRegisters {
+    uint64_t args[6]; // Linux syscall args: rdi, rsi, rdx, r10, r8, r9
+    uint64_t rbx, rbp, r12, r13, r14, r15; // preserved across syscalls
+    uint64_t rip; // user code address to return to (from rcx)
+    uint64_t rflags; // user flags (from r11)
+    uint64_t rsp; // user stack
+    
+    /// Return syscall argument i (0-5) as this type
+    template <class T> T arg(int i) const { return (T)args[i]; }
+};
+
+/// Run code with these registers and rax, until it exits (asm_util.s)
+extern "C" uint64_t start_with_registers(SyscallRegisters *regs,uint64_t rax);
+
+/// One PT_LOAD segment of a Linux program
+struct ProgramSegment {
+    uint64_t vaddr; // program address of the first byte
+    uint64_t memsz; // bytes in memory
+    uint64_t offset; // file offset of the first byte
+    uint64_t filesz; // bytes that come from the file (the rest is zeroed BSS)
+    int perm; // PagePermissions for its pages
+};
+
+/// Where the kernel puts things in every Linux program's address space.
+///  Programs' segments must stay clear of these, and of physical RAM
+///  (see physical_memory_end), since the kernel fills program pages
+///  through its identity mapping while the program's pagetable is active.
+const VirtualAddress USER_STACK_TOP=0x7ff000000000ull; // programs' stacks end here
+enum {USER_STACK_BYTES=256*1024};
+const VirtualAddress BENCHMARK_CODE=0x7fe000000000ull; // benchmark_syscalls' code page, then its stack page
+const VirtualAddress USER_HALF_END=0x800000000000ull; // end of the user half of the address space
+
+/**
+ A Linux program's address space.  Nothing gets mapped up front.
+ A cached LinuxImage's program never runs: it just holds the pages 
+ with file data, read straight in from the file when it's loaded 
+ (page faults can't call UEFI).  Each launch shares those pages the
+ first time it touches them, writable data copy-on-write.  BSS and 
+ stack pages are just zeroed when they're touched, and pages never 
+ touched cost nothing.
+*/
+class LinuxProgram : public PageFaultHandler {
+public:
+    PageTable pagetable;
+    uint64_t faults; // number of pages faulted in
+    
+    /// An image: LinuxImage::load adds its segments and their pages
+    LinuxProgram() :image(0) {
+        faults=0;
+        nsegments=0;
+        nchildren=0;
+        pagetable.set_fault_handler(this);
+    }
+    
+    /// A copy of parent (a forked program, or a cached LinuxImage).
+    ///   A fork gets all the parent's pages copy-on-write, so nothing is 
+    ///   copied until one of us writes to it.  A launch of an image starts
+    ///   empty, and shares the image's pages as it touches them.  Either way
+    ///   read-only text just stays shared.
+    LinuxProgram(LinuxProgram &parent) 
+        :image(parent.image?parent.image:&parent)
+    {
+        faults=0;
+        nsegments=parent.nsegments;
+        for (int s=0;s<nsegments;s++) segments[s]=parent.segments[s];
+        nchildren=0;
+        pagetable.set_fault_handler(this);
+        if (parent.image) parent.pagetable.clone(pagetable); // (images never change after load)
+    }
+    
+    /// Free all the pages we faulted in (or drop our share of them)
+    ~LinuxProgram() {
+        for (int s=0;s<nsegments;s++) {
+            const ProgramSegment &seg=segments[s];
+            VirtualAddress start=seg.vaddr&~(uint64_t)(PageSize-1);
+            VirtualAddress end=(seg.vaddr+seg.memsz+PageSize-1)&~(uint64_t)(PageSize-1);
+            pagetable.release_pages(start,end-start); // (pages shared by two segments go once)
+        }
+        pagetable.flush_TLB();
+    }
+    
+    /// Add this ELF program header's segment (it doesn't get loaded yet)
+    const ProgramSegment &add_segment(const Elf64_Phdr *ph) {
+        if (nsegments>=MAX_SEGMENTS) panic("Too many ELF segments: ",nsegments);
+        ProgramSegment &seg=segments[nsegments++];
+        seg.vaddr=ph->p_vaddr;
+        seg.memsz=ph->p_memsz;
+        seg.offset=ph->p_offset;
+        seg.filesz=ph->p_filesz<ph->p_memsz?ph->p_filesz:ph->p_memsz;
+        seg.perm=UserAccess;
+        if (ph->p_flags&PF_R) seg.perm|=Readable;
+        if (ph->p_flags&PF_W) seg.perm|=Writable;
+        if (ph->p_flags&PF_X) seg.perm|=Executable;
+        return seg;
+    }
+    
+    /// Add a stack of this many bytes, ending at top.  Its pages fault in
+    ///  as they're touched: the program runs in ring 3, so the CPU pushes
+    ///  its page faults onto our kernel stack, not this one.
+    void add_stack(VirtualAddress top,uint64_t bytes) {
+        if (nsegments>=MAX_SEGMENTS) panic("Too many ELF segments: ",nsegments);
+        ProgramSegment &seg=segments[nsegments++];
+        seg.vaddr=top-bytes;
+        seg.memsz=bytes;
+        seg.offset=seg.filesz=0;
+        seg.perm=Readable|Writable|UserAccess;
+    }
+    
+    /// Remember this child exited, for wait4
+    void add_child(int pid,int exit_code) {
+        if (nchildren>=MAX_CHILDREN) panic("Too many unwaited child processes: ",nchildren);
+        child_pids[nchildren]=pid;
+        child_exits[nchildren]=exit_code;
+        nchildren++;
+    }
+    
+    /// Take an exited child with this pid (or -1 for any) out of our list.
+    ///  Returns its pid, or 0 if there isn't one.
+    int wait_child(int pid,int &exit_code) {
+        for (int c=0;c<nchildren;c++) 
+            if (pid==-1 || child_pids[c]==pid) {
+                pid=child_pids[c];
+                exit_code=child_exits[c];
+                nchildren--;
+                child_pids[c]=child_pids[nchildren];
+                child_exits[c]=child_exits[nchildren];
+                return pid;
+            }
+        return 0;
+    }
+    
+    /// Return true if the program may access every byte from ptr to ptr+len
+    ///  with these permissions.  Syscalls check user pointers with this 
+    ///  before touching them, since the kernel can write anywhere.
+    bool user_range(VirtualAddress ptr,uint64_t len,int perm) const {
+        VirtualAddress end=ptr+len;
+        if (end<ptr) return false; // wraps around
+        for (VirtualAddress page=ptr&~(uint64_t)(PageSize-1);page<end;page+=PageSize)
+            if ((page_perm(page)&perm)!=perm) return false;
+        return true;
+    }
+    
+    /// First touch of a program page: if the image has file data there,
+    ///  share its copy, otherwise it's BSS (or stack) and just gets zeroed.
+    ///  The zeroing goes through the kernel's identity mapping, which is
+    ///  why LinuxImage::load keeps programs off RAM the buddy hands out.
+    virtual bool handle_page_fault(PageTable &pt,VirtualAddress addr,uint64_t error) {
+        if (error&PF_PRESENT) return false; // e.g., a write to read-only text
+        VirtualAddress page=addr&~(uint64_t)(PageSize-1);
+        int perm=page_perm(page);
+        if (perm==0) return false; // not part of the program
+        
+        PhysicalAddress file_page=image?image->pagetable.lookup(page):0;
+        if (file_page) pagetable.add_shared(file_page,page,perm);
+        else {
+            PhysicalAddress phys=AllocatePage();
+            memset((void *)phys,0,PageSize);
+            pagetable.add(phys,page,perm);
+        }
+        faults++;
+        return true;
+    }
+    
+private:
+    LinuxProgram *image; // where our file pages come from (0 if we're an image)
+    enum {MAX_SEGMENTS=16};
+    ProgramSegment segments[MAX_SEGMENTS];
+    int nsegments;
+    
+    enum {MAX_CHILDREN=16};
+    int child_pids[MAX_CHILDREN]; // children that exited, but haven't been waited for
+    int child_exits[MAX_CHILDREN];
+    int nchildren;
+    
+    /// Return the combined permissions of the segments covering this page (usually one)
+    int page_perm(VirtualAddress page) const {
+        int perm=0;
+        for (int s=0;s<nsegments;s++) 
+            if (overlap(segments[s],page)) perm|=segments[s].perm;
+        return perm;
+    }
+    
+    /// Return true if this segment covers part of this page
+    static bool overlap(const ProgramSegment &seg,VirtualAddress page) {
+        return seg.vaddr<page+PageSize && seg.vaddr+seg.memsz>page;
+    }
+};
+
+
 // Syscall numbers from https://chromium.googlesource.com/chromiumos/docs/+/master/constants/syscalls.md
 enum {
     syscallWrite=1,
     syscallOpen=2,
-    syscallArch_prctl=158,
-    syscallExit=60
+    syscallGetpid=39,
+    syscallFork=57,
+    syscallVfork=58,
+    syscallExit=60,
+    syscallWait4=61,
+    syscallArch_prctl=158
 };
 
-extern "C" uint64_t handle_syscall(uint64_t syscallNumber,uint64_t *args)
-{
-    print("  syscall ");
-    print((int)syscallNumber);
-    if (syscallNumber==syscallWrite) {
-        int fd=args[0];
-        void *ptr=(void *)args[1];
-        uint64_t len=args[2];
-        print("write(");
-        print(fd);
-        println(")");
-        if (fd==1) // stdout
-            print(ByteBuffer(ptr,len));
-        else
-            panic("Unknown fd",fd);
-    }
-    else if (syscallNumber==syscallOpen) {
-        const char *pathname=(const char *)args[0];
-        uint64_t flags=args[1];
-        uint64_t mode=args[2];
-        print("open(");
-        print(pathname);
-        print(",");
-        print(flags);
-        print(",");
-        print(mode);
-        println(")");
-        return -1; // return error (no open yet!)
-    }
-    else if (syscallNumber==syscallExit) {
-        print("exit(");
-        int exitcode=args[0];
-        print(exitcode);
-        println(")");
-        // FIXME: switch back to kernel main stack
-        return_to_main_stack();
-        panic("tried to return to main stack, but didn't!");
-    }
-    else panic("Unknown syscall",syscallNumber);
-    return 0;
-}
+enum {LINUX_ECHILD=10}; // Linux error: no child processes
+enum {LINUX_EFAULT=14}; // Linux error: bad address
+
+/**
+ Buffers program output to the console, so a chatty program makes one
+ firmware call per write that ends a line (or fills the buffer), not one
+ per write.  Bytes get widened to CHAR16 (and \n to \r\n) as they're 
+ copied in, so a flush is just the OutputString call.  Long writes 
+ take several flushes, nothing gets truncated.
+ All zeros is empty, so these work without a constructor.
+*/
+class ConsoleBuffer {
+public:
+    enum {SIZE=1024}; // CHAR16s in the buffer
+    uint64_t writes; // number of write calls
+    uint64_t flushes; // number of firmware calls
+    
+    /// Add these bytes, and flush if they finished a line.
+    void write(const Byte *data,uint64_t len) {
+        writes++;
+        bool newline=false;
+        for (uint64_t i=0;i<len;i++) {
+            if (out+3>SIZE) flush(); // leave room for \r\n and the nul
+            CHAR16 c=data[i];
+            if (c=='\n') { wide[out++]='\r'; newline=true; }
+            wide[out++]=c;
+        }
+        if (newline) flush();
+    }
+    
+    /// Send everything buffered to the console
+    void flush(void) {
+        if (out==0) return;
+        wide[out]=0;
+        ST->ConOut->OutputString(ST->ConOut,wide);
+        out=0;
+        flushes++;
+    }
+private:
+    uint64_t out; // CHAR16s in wide
+    CHAR16 wide[SIZE];
+};
 
-// Put this file's data into memory at this address.
-//  (FIXME: into program memory, not kernel memory!)
-void map_file_to_memory(FileDataStringSource &exe,
-    uint64_t file_offset, uint64_t size, uint64_t address)
+/// What one core is running.  Each core has its own, so programs on
+///   different cores can make syscalls at the same time.
+struct LinuxCore {
+    LinuxProgram *program; // the Linux program running now (its address space)
+    int pid; // its process ID
+    int exit_code; // exit code of the last program here that called exit
+    ConsoleBuffer console; // programs' stdout
+    uint64_t forks; // fork children run by this launch (vfork shares memory, so isn't counted)
+    uint64_t fork_copies; // pages those children copied on write
+    uint64_t fork_faults; // pages those children faulted in
+};
+LinuxCore linux_cores[MAX_CPUS];
+int next_pid=1; // (atomic)
+
+/// Return the LinuxCore for the core we're running on
+inline LinuxCore &this_core(void) { return linux_cores[cpu_index()]; }
+
+/// Run a copy of the calling program until it exits: the child returns 0 from
+///   this syscall, and the parent gets the child's pid.  With vfork the child 
+///   uses our address space, so it must only exec or exit (like Linux);
+///   a fork child gets its own address space, copy-on-write.
+///  FIXME: there's no scheduler yet, so the parent waits for the child to exit.
+uint64_t fork_program(SyscallRegisters *regs,bool share_memory)
 {
-    const uint64_t BLOCK=FileDataStringSource::BLOCK_SIZE;
-    uint64_t index=file_offset/BLOCK;
-    uint64_t round_down=file_offset%BLOCK;
-    address-=round_down;
-    uint64_t end_index=(round_down+size+BLOCK-1)/BLOCK;
+    LinuxCore &core=this_core();
+    LinuxProgram *parent=core.program;
+    int parent_pid=core.pid;
+    int pid=__atomic_fetch_add(&next_pid,1,__ATOMIC_RELAXED);
+    core.pid=pid;
     
-    print("Filling program address ");
-    print(address);
-    print(" from file block ");
-    print(index);
-    println();
+    if (share_memory) {
+        start_with_registers(regs,0);
+    }
+    else {
+        LinuxProgram child(*parent);
+        core.program=&child;
+        child.pagetable.activate();
+        start_with_registers(regs,0);
+        parent->pagetable.activate();
+        core.program=parent;
+        core.forks++; // (run_linux reports these after the program exits)
+        core.fork_copies+=child.pagetable.cow_copies;
+        core.fork_faults+=child.faults;
+    } // <- child's pages get released here
     
-    // Copy the file data out to memory
-    ByteBuffer buf;
-    Byte *out=(Byte *)address;
-    while (exe.get(buf,index++)) {
-        for (Byte b:buf) *out++=b;
-        if (index>=end_index) break;
+    core.pid=parent_pid;
+    parent->add_child(pid,core.exit_code);
+    return pid;
+}
+
+/* Syscall handlers: each gets the user's registers, and returns rax. */
+typedef uint64_t (*syscall_handler_t)(SyscallRegisters &regs);
+
+uint64_t sys_write(SyscallRegisters &regs)
+{
+    int fd=regs.arg<int>(0);
+    const void *ptr=regs.arg<const void *>(1);
+    uint64_t len=regs.arg<uint64_t>(2);
+    LinuxCore &core=this_core();
+    if (fd!=1) panic("Unknown fd",fd); // (only stdout so far)
+    if (!core.program->user_range((VirtualAddress)ptr,len,Readable|UserAccess)) 
+        return -LINUX_EFAULT;
+    core.console.write((const Byte *)ptr,len);
+    return len;
+}
+
+uint64_t sys_open(SyscallRegisters &regs)
+{
+    return -1; // return error (no open yet!)
+}
+
+uint64_t sys_getpid(SyscallRegisters &regs)
+{
+    return this_core().pid;
+}
+
+uint64_t sys_fork(SyscallRegisters &regs)
+{
+    return fork_program(&regs,false);
+}
+
+uint64_t sys_vfork(SyscallRegisters &regs)
+{
+    return fork_program(&regs,true);
+}
+
+uint64_t sys_wait4(SyscallRegisters &regs)
+{
+    int pid=regs.arg<int>(0);
+    int *wstatus=regs.arg<int *>(1);
+    if (wstatus && !this_core().program->user_range((VirtualAddress)wstatus,sizeof(int),Writable|UserAccess))
+        return -LINUX_EFAULT;
+    int exitcode=0;
+    pid=this_core().program->wait_child(pid,exitcode);
+    if (pid==0) return -LINUX_ECHILD;
+    if (wstatus) *wstatus=(exitcode&0xff)<<8; // WIFEXITED, WEXITSTATUS
+    return pid;
+}
+
+uint64_t sys_exit(SyscallRegisters &regs)
+{
+    LinuxCore &core=this_core();
+    core.exit_code=regs.arg<int>(0);
+    core.console.flush(); // the program's last partial line
+    return_to_main_stack();
+    panic("tried to return to main stack, but didn't!");
+    return 0;
+}
+
+/// One Linux syscall we handle
+struct SyscallInfo {
+    uint64_t number;
+    const char *name;
+    syscall_handler_t handler;
+};
+
+/// All the syscalls we handle
+constexpr SyscallInfo syscall_list[]={
+    {syscallWrite,"write",sys_write},
+    {syscallOpen,"open",sys_open},
+    {syscallGetpid,"getpid",sys_getpid},
+    {syscallFork,"fork",sys_fork},
+    {syscallVfork,"vfork",sys_vfork},
+    {syscallExit,"exit",sys_exit},
+    {syscallWait4,"wait4",sys_wait4},
+};
+
+/// syscall_list indexed by syscall number (0 for the ones we don't handle).
+///   It's built by the compiler, since no global constructors run in the kernel.
+enum {SYSCALL_COUNT=512};
+struct SyscallTable {
+    const SyscallInfo *info[SYSCALL_COUNT];
+    constexpr SyscallTable() :info() {
+        for (const SyscallInfo &s:syscall_list) info[s.number]=&s;
     }
+};
+constexpr SyscallTable syscall_table;
+
+
+/* Syscall tracing, into a ring buffer in memory.  It's off by default,
+   since printing every syscall costs far more than the syscall. */
+struct SyscallTraceEntry {
+    uint64_t number;
+    uint64_t args[3]; // first few arguments
+    uint64_t result;
+    uint64_t cycles; // clock cycles in the handler
+};
+enum {SYSCALL_TRACE_SIZE=256}; // (a power of two)
+bool syscall_tracing=false;
+SyscallTraceEntry syscall_trace[SYSCALL_TRACE_SIZE];
+uint64_t syscall_trace_count=0; // total syscalls traced
+
+/// Run this syscall, and record it in the trace ring
+uint64_t traced_syscall(uint64_t syscallNumber,syscall_handler_t handler,SyscallRegisters &regs)
+{
+    uint64_t index=__atomic_fetch_add(&syscall_trace_count,1,__ATOMIC_RELAXED);
+    SyscallTraceEntry &t=syscall_trace[index%SYSCALL_TRACE_SIZE];
+    t.number=syscallNumber;
+    for (int i=0;i<3;i++) t.args[i]=regs.args[i];
+    t.result=t.cycles=0; // (exit never returns)
+    uint64_t start=rdtsc();
+    uint64_t result=handler(regs);
+    t.cycles=rdtsc()-start;
+    t.result=result;
+    return result;
+}
+
+void print_syscall_trace(void)
+{
+    uint64_t n=syscall_trace_count<SYSCALL_TRACE_SIZE?syscall_trace_count:SYSCALL_TRACE_SIZE;
+    for (uint64_t i=syscall_trace_count-n;i<syscall_trace_count;i++) {
+        const SyscallTraceEntry &t=syscall_trace[i%SYSCALL_TRACE_SIZE];
+        print("  "); print(syscall_table.info[t.number]->name); print("(");
+        for (int a=0;a<3;a++) { if (a) print(","); print_hex(t.args[a]); }
+        print(") = "); print((int64_t)t.result);
+        print("  "); print((int64_t)t.cycles); println(" cycles");
+    }
+}
+
+void toggle_syscall_trace(void)
+{
+    print_syscall_trace();
+    syscall_tracing=!syscall_tracing;
+    println(syscall_tracing?"Syscall tracing on.":"Syscall tracing off.");
+}
+
+extern "C" uint64_t handle_syscall(uint64_t syscallNumber,SyscallRegisters *regs)
+{
+    const SyscallInfo *info=syscallNumber<SYSCALL_COUNT?syscall_table.info[syscallNumber]:0;
+    if (info==0) panic("Unknown syscall",syscallNumber);
+    if (syscall_tracing) return traced_syscall(syscallNumber,info->handler,*regs);
+    return info->handler(*regs);
+}
+
+
+/// User code that makes SYSCALL_BENCHMARK_CALLS getpid syscalls, then exits
+///   with the clock cycles they took (in util_asm.s).  We copy it to a user page.
+extern "C" void user_syscall_benchmark(void);
+extern "C" void user_syscall_benchmark_end(void);
+enum {SYSCALL_BENCHMARK_CALLS=10000}; // (also in util_asm.s)
+
+void benchmark_syscalls(void)
+{
+    // A tiny user program: a page of code, and a page of stack.
+    //  High in the user half, well above RAM, so we don't cover the identity map.
+    const VirtualAddress code=BENCHMARK_CODE, stack_top=code+2*PageSize;
+    PageTable pagetable;
+    PhysicalAddress page=AllocatePage();
+    memcpy((void *)page,(const void *)user_syscall_benchmark,
+        (uint64_t)user_syscall_benchmark_end-(uint64_t)user_syscall_benchmark);
+    pagetable.add(page,code,Readable|Executable|UserAccess);
+    pagetable.add(AllocatePage(),stack_top-PageSize,Readable|Writable|UserAccess);
+    pagetable.activate();
+    syscall_setup();
     
+    LinuxCore &core=this_core();
+    bool was_tracing=syscall_tracing;
+    for (int trace=0;trace<2;trace++) {
+        syscall_tracing=trace;
+        start_function_with_stack((function_t)code,(uint64_t *)stack_top);
+        print("Null syscall (getpid) round trip: ");
+        print((int64_t)((uint32_t)core.exit_code/SYSCALL_BENCHMARK_CALLS));
+        println(trace?" cycles, with tracing":" cycles");
+    }
+    syscall_tracing=was_tracing;
+    syscall_finish();
+    PageTable::deactivate();
+    pagetable.release_pages(code,PageSize);
+    pagetable.release_pages(stack_top-PageSize,PageSize);
 }
 
+
 // Set up a new stack for a new Linux program.
 //  Returns the new stack pointer the program can use.
 //  Initialized according to the Linux SysV ABI here:
@@ -98,8 +500,15 @@ void map_file_to_memory(FileDataStringSource &exe,
 //  (See Section 3.4, Figure 3.9)
 uint64_t *setup_stack(const char *program_name,uint64_t *start,uint64_t STACKSIZE)
 {
-    // Stack grows to lower addresses, so start at end of buffer.
-    uint64_t *rsp=&start[STACKSIZE];
+    // Stack grows to lower addresses, so start at end of buffer,
+    //  with a copy of the program name (user code can't read ours).
+    uint64_t len=0;
+    while (program_name[len]!=0) len++;
+    char *name=(char *)&start[STACKSIZE]-(len+1);
+    memcpy(name,program_name,len+1);
+    
+    // The 5 pushes below leave rsp 16-byte aligned, as the ABI wants at _start
+    uint64_t *rsp=(uint64_t *)((((uint64_t)name)&~(uint64_t)15)-8);
     
     *(--rsp)=0; // "push" null auxvector entry
     // auxvector entries go here: see https://github.com/torvalds/linux/blob/master/include/uapi/linux/auxvec.h
@@ -108,62 +517,239 @@ uint64_t *setup_stack(const char *program_name,uint64_t *start,uint64_t STACKSIZ
     *(--rsp)=0; // "push" null after environment variables
     // environment variables go here
     *(--rsp)=0; // last argument 
-    *(--rsp)=(uint64_t)program_name; // program arguments go here
+    *(--rsp)=(uint64_t)name; // program arguments go here
     *(--rsp)=1; // number of arguments, including program name itself
     return rsp; //<- from the ABI, QWORD[rsp] == argc
 }
 
 
+/**
+ A Linux executable that's already been read in.  Its pages never run
+ themselves: each launch shares them as it touches them, the read-only
+ text directly and the writable data copy-on-write, so a relaunch 
+ doesn't read anything from the disk.
+*/
+class LinuxImage {
+public:
+    enum {MAX_PATH=128};
+    char path[MAX_PATH]; // file it came from
+    uint64_t size; // file size and modification time when we read it
+    EFI_TIME modified;
+    uint64_t entry; // program's start address
+    uint64_t launches; // number of times it's been run
+    int refs; // the cache, plus each launch using it (see unpin_image)
+    uint64_t load_bytes; // bytes read from the file
+    uint64_t load_cycles; // clock cycles spent reading them
+    FileDataStringSource exe;
+    LinuxProgram program; // holds the pages with file data
+    
+    LinuxImage(const char *path_,const FileDataStringSource &file,uint64_t size_,const EFI_TIME &modified_)
+        :size(size_), modified(modified_), entry(0), launches(0), refs(1), load_bytes(0), load_cycles(0),
+         exe(file)
+    {
+        strncpy(path,path_,MAX_PATH-1);
+        path[MAX_PATH-1]=0;
+    }
+    ~LinuxImage() { exe.close(); }
+    
+    /// Parse the file's ELF headers, and read each segment's file data 
+    ///   into the image's pages.  Everything gets read here, on the core
+    ///   that's launching us, since page faults can't call UEFI (they may 
+    ///   be on any core, with interrupts off).
+    ///   Returns 0 if it worked, or a negative error code.
+    int load(void) {
+        uint64_t start_time=rdtsc();
+        Elf64_Ehdr elf;
+        if (size<sizeof(elf) || exe.read(0,&elf,sizeof(elf))!=sizeof(elf)) {
+            print("Can't read ELF file.\n");
+            return -101;
+        }
+        if (elf.e_machine!=EM_X86_64) {
+            print("Wrong arch!\n");
+            return -102;
+        }
+        entry=elf.e_entry;
+        uint64_t phdr_bytes=(uint64_t)elf.e_phnum*elf.e_phentsize;
+        if (elf.e_phentsize<sizeof(Elf64_Phdr) || elf.e_phoff+phdr_bytes>size) {
+            print("ELF program headers past the end of the file.\n");
+            return -103;
+        }
+        Byte *phdrs=(Byte *)galloc(phdr_bytes);
+        int err=0;
+        if (exe.read(elf.e_phoff,phdrs,phdr_bytes)!=phdr_bytes) {
+            print("Can't read ELF program headers.\n");
+            err=-101;
+        }
+        
+        // Add each of the file's segments, and read in their file data
+        for (int p=0;p<elf.e_phnum && err==0;p++) {
+            const Elf64_Phdr *ph=(const Elf64_Phdr *)(phdrs + p*elf.e_phentsize);
+            if (ph->p_type!=PT_LOAD) continue; // <- we only care about loadable segments
+            if (ph->p_offset+ph->p_filesz<ph->p_offset || ph->p_offset+ph->p_filesz>size) {
+                print("ELF segment past the end of the file.\n");
+                err=-103;
+            }
+            else if (!segment_allowed(ph)) {
+                print("ELF segment covers memory the kernel uses.\n");
+                err=-104;
+            }
+            else if (!load_segment(program.add_segment(ph))) {
+                print("Can't read ELF segment.\n");
+                err=-101;
+            }
+        }
+        gfree(phdrs);
+        exe.close();
+        load_cycles=rdtsc()-start_time;
+        return err;
+    }
+    
+private:
+    /// Return true if this segment stays in the user half, and clear of
+    ///   RAM and the kernel's windows in every program's address space.
+    static bool segment_allowed(const Elf64_Phdr *ph) {
+        VirtualAddress lo=ph->p_vaddr, hi=ph->p_vaddr+ph->p_memsz;
+        if (hi<lo || hi>USER_HALF_END) return false;
+        return !overlaps(lo,hi,LOW_MEMORY,physical_memory_end())
+            && !overlaps(lo,hi,USER_STACK_TOP-USER_STACK_BYTES,USER_STACK_TOP)
+            && !overlaps(lo,hi,BENCHMARK_CODE,BENCHMARK_CODE+2*PageSize);
+    }
+    static bool overlaps(uint64_t lo,uint64_t hi,uint64_t start,uint64_t end) {
+        return lo<end && start<hi;
+    }
+    
+    /// Read this segment's file data straight into the image's pages: one
+    ///   Read into new contiguous pages, plus one into the page the last
+    ///   segment ended on, if we share it.  Only the bytes around the file
+    ///   data get zeroed.  Returns false if the file comes up short.
+    bool load_segment(const ProgramSegment &seg) {
+        VirtualAddress lo=seg.vaddr, hi=seg.vaddr+seg.filesz; // file data
+        
+        // A page the last segment already filled keeps its data
+        VirtualAddress page=lo&~(uint64_t)(PageSize-1);
+        PhysicalAddress phys=lo<hi?program.pagetable.lookup(page):0;
+        if (phys) {
+            uint64_t n=(hi<page+PageSize?hi:page+PageSize)-lo;
+            if (!read_file(seg.offset,phys+(lo-page),n)) return false;
+            lo+=n;
+        }
+        if (lo>=hi) return true; // (BSS just gets faulted in by each launch)
+        
+        // The rest go in new pages (mapped first, so the destructor frees them)
+        VirtualAddress start=lo&~(uint64_t)(PageSize-1);
+        VirtualAddress end=(hi+PageSize-1)&~(uint64_t)(PageSize-1);
+        phys=AllocatePages((end-start)/PageSize);
+        program.pagetable.add_range(phys,start,end-start,SetOfPagePermissions(seg.perm));
+        memset((void *)phys,0,lo-start); // before the file data
+        memset((void *)(phys+(hi-start)),0,end-hi); // the start of the BSS
+        return read_file(seg.offset+(lo-seg.vaddr),phys+(lo-start),hi-lo);
+    }
+    
+    /// Read these bytes of the file into this physical memory
+    bool read_file(uint64_t offset,PhysicalAddress dest,uint64_t bytes) {
+        uint64_t got=exe.read(offset,(void *)dest,bytes);
+        load_bytes+=got;
+        return got==bytes;
+    }
+};
+
+/// Executables we've already read in, so running them again is cheap
+enum {IMAGE_CACHE_SIZE=8};
+LinuxImage *image_cache[IMAGE_CACHE_SIZE];
+int image_cache_next=0; // slot to replace when the cache is full
+uint64_t image_cache_hits=0, image_cache_misses=0;
+SpinLock image_cache_lock; // protects the cache (but not the images in it)
+
+/// Drop one reference to this image, and delete it once nobody uses it
+void unpin_image(LinuxImage *image)
+{
+    if (__atomic_sub_fetch(&image->refs,1,__ATOMIC_ACQ_REL)==0) delete image;
+}
+
+/// Return the loaded image of this executable, reading it in if it isn't
+///   cached yet or the file has changed since.  The image comes back pinned,
+///   so call unpin_image when you're done.  On errors, returns 0 and 
+///   sets err to a negative error code.
+LinuxImage *find_image(const char *path,int &err)
+{
+    FileDataStringSource file=FileContents(path);
+    uint64_t size=0;
+    EFI_TIME modified;
+    file.stat(size,modified);
+    
+    LinuxImage *old=0; // image we took out of the cache (unpinned outside the lock)
+    { // Is it cached?  (Only hold the lock for the lookup, not the disk.)
+        lock_guard<SpinLock> guard(image_cache_lock);
+        for (int i=0;i<IMAGE_CACHE_SIZE;i++) {
+            LinuxImage *image=image_cache[i];
+            if (image && strcmp(image->path,path)==0) {
+                if (image->size==size && memcmp(&image->modified,&modified,sizeof(modified))==0) {
+                    __atomic_add_fetch(&image->refs,1,__ATOMIC_RELAXED);
+                    image_cache_hits++;
+                    file.close();
+                    return image;
+                }
+                image_cache[i]=0; // file changed, so read it again
+                old=image;
+            }
+        }
+        image_cache_misses++;
+    }
+    if (old) unpin_image(old);
+    
+    LinuxImage *image=new LinuxImage(path,file,size,modified); // (pinned for us)
+    err=image->load();
+    if (err!=0) { unpin_image(image); return 0; }
+    
+    {
+        lock_guard<SpinLock> guard(image_cache_lock);
+        int slot=-1;
+        for (int i=0;i<IMAGE_CACHE_SIZE && slot<0;i++) // (another core may have loaded it too)
+            if (image_cache[i]==0 || strcmp(image_cache[i]->path,path)==0) slot=i;
+        if (slot<0) { // cache is full: replace the slots in turn
+            slot=image_cache_next;
+            image_cache_next=(slot+1)%IMAGE_CACHE_SIZE;
+        }
+        old=image_cache[slot];
+        __atomic_add_fetch(&image->refs,1,__ATOMIC_RELAXED); // the cache's reference
+        image_cache[slot]=image;
+    }
+    if (old) unpin_image(old);
+    return image;
+}
+
 // Load and execute a Linux program from this file:
 int run_linux(const char *program_name)
 {
   // Program p("APPS/PROG"); // <- aspirational interface
   
-  // Load a program's ELF header
-  FileDataStringSource exeELF=FileContents(program_name);
-  ByteBuffer elfHeader;
-  if (!exeELF.get(elfHeader,0)) {
-    print("Can't read ELF file.\n");
-    return -101;
-  }
-  const Byte *elfHeaderData=elfHeader.begin();
-  const Elf64_Ehdr *elf=(const Elf64_Ehdr *)elfHeaderData;
-  if (elf->e_machine!=EM_X86_64) {
-    print("Wrong arch!\n");
-    return -102;
-  }
-  
-  // Load each of the program's segments
-  //  SUBTLE: ELF header will go away as we read, so open file again.
-  FileDataStringSource exe=FileContents(program_name);
+  // Find the program's image, already read in if we've run it before
+  int err=0;
+  LinuxImage *image=find_image(program_name,err);
+  if (image==0) return err;
+  uint64_t launches=__atomic_add_fetch(&image->launches,1,__ATOMIC_RELAXED);
+  uint64_t load_bytes=image->load_bytes, load_cycles=image->load_cycles;
+  function_t f=(function_t)image->entry;
   
-  // Map in each of the file's segments
-  //   FIXME: sanity check these before mapping in
-  for (int p=0;p<elf->e_phnum;p++) {
-        const Byte *pstart=elfHeaderData + elf->e_phoff + p*elf->e_phentsize;
-        const Elf64_Phdr *ph=(const Elf64_Phdr *)pstart;
-        if (ph->p_type==PT_LOAD) // <- we only care about loadable segments
-        {
-        /*  // FIXME: respect RWX flags for file's pieces
-            bool R=(ph->p_flags&PF_R);
-            bool W=(ph->p_flags&PF_W);
-            bool X=(ph->p_flags&PF_X);
-        */
-            
-            map_file_to_memory(exe,ph->p_offset,ph->p_memsz,ph->p_vaddr);
-        }
-  }
+  // The program gets its own address space: it shares the image's text,
+  //   gets the image's data copy-on-write, and the BSS fills in as it runs.
+  //   (It needs the image until it exits, so the image stays pinned.)
+  LinuxProgram program(image->program);
+  program.pagetable.activate();
+  LinuxCore &core=this_core();
+  core.program=&program;
+  core.pid=__atomic_fetch_add(&next_pid,1,__ATOMIC_RELAXED);
+  core.forks=core.fork_copies=core.fork_faults=0;
   
   // Set up syscalls  
   print("syscalls\n");
   syscall_setup();
   
   // Run the program
-  function_t f=(function_t)elf->e_entry;
-  
   print("Allocating stack\n");
-  enum {STACKSIZE=32*1024};
-  uint64_t *stack=new uint64_t[STACKSIZE];
+  enum {STACKSIZE=USER_STACK_BYTES/sizeof(uint64_t)};
+  program.add_stack(USER_STACK_TOP,USER_STACK_BYTES); // (high in the user half)
+  uint64_t *stack=(uint64_t *)(USER_STACK_TOP-USER_STACK_BYTES);
   uint64_t *new_rsp=setup_stack(program_name,stack,STACKSIZE);
   print("Running linux program {\n");
   
@@ -172,12 +758,35 @@ int run_linux(const char *program_name)
   print("}\n");
   
   print((int)ret);
-  print(" was the return value.\n");
+  print(" was the return value, ");
+  print(core.exit_code);
+  print(" the exit code.\n");
+  print((int64_t)core.console.writes); print(" console writes, in ");
+  print((int64_t)core.console.flushes); println(" firmware calls.");
   println();
 
   syscall_finish();
   
-  delete[] stack;
+  // Back to the kernel's address space (program's pages get freed on return)
+  PageTable::deactivate();
+  core.program=0;
+  unpin_image(image); // (our pages hold their own references)
+  print((int64_t)program.faults); println(" pages faulted in.");
+  print((int64_t)program.pagetable.cow_copies); println(" pages copied on write.");
+  if (core.forks) {
+    print((int64_t)core.forks); print(" fork children copied ");
+    print((int64_t)core.fork_copies); print(" pages on write, and faulted in ");
+    print((int64_t)core.fork_faults); println(".");
+  }
+  if (launches==1) {
+    print((int64_t)load_bytes); print(" bytes loaded from the file, at ");
+    print((int64_t)(load_bytes*1000/(load_cycles+1))); println(" bytes per kilocycle.");
+  }
+  else {
+    print("Launch "); print((int64_t)launches); println(" of the cached image.");
+  }
+  print("Image cache: "); print((int64_t)image_cache_hits); print(" hits, ");
+  print((int64_t)image_cache_misses); println(" misses.");
   
   return 0; // it worked!
 }
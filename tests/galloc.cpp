@@ -0,0 +1,483 @@
+/*
+ Benchmarks and stress tests for the galloc memory allocator,
+ run outside the kernel, where we have threads, timers, and gdb.
+
+ Physical pages come from one big mmap'd range below 64GB
+ (the heap directory's limit), so addresses look like the kernel's.
+
+ Build and run with "make" in this directory.
+*/
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <deque>
+#include <vector>
+#include <chrono>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#define GLaDOS_HOSTED 1   /* standalone, don't redefine compiler's datatypes */
+#define GLaDOS_IMPLEMENT_MEMORY 1
+#include "GLaDOS/GLaDOS.h"
+
+
+/* Hosted versions of the kernel's print and panic */
+void print(const char *str) { std::cout<<str; }
+void print(const StringSource &str) {
+  ByteBuffer buf;
+  for (int i=0;str.get(buf,i);i++)
+    for (char c:buf) std::cout<<c;
+}
+void print(int value) { std::cout<<value<<" "; }
+void print(int64_t value) { std::cout<<value<<" "; }
+void print(uint64_t value) { std::cout<<std::hex<<"0x"<<value<<std::dec<<" "; }
+void println(void) { std::cout<<"\n"; }
+void println(const StringSource &str) { print(str); println(); }
+void print_hex(uint64_t value,long digits,char separator) { print(value); }
+
+void panic(const char *why,uint64_t number) {
+  std::cout<<"======= galloc test panic! =======\n"<<why<<number<<std::endl;
+  abort();
+}
+
+
+/* Hosted "physical memory": a buddy allocator over a reserved address range,
+   like the kernel's.  Freed pages get handed back to Linux. */
+const uint64_t phys_base=4ull<<30, phys_size=32ull<<30;
+PageBuddy physical_pages;
+
+void setup_physical_memory(void)
+{ // bookkeeping goes at the start of the range, like setup_physical_memory in util.cpp
+  uint64_t meta_pages=PageBuddy::meta_bytes(phys_base,phys_base+phys_size)/PageSize;
+  physical_pages.setup(phys_base,phys_base+phys_size,(uint8_t *)phys_base);
+  physical_pages.add(phys_base+meta_pages*PageSize,phys_size/PageSize-meta_pages);
+}
+
+PhysicalAddress AllocatePages(uint64_t count,uint64_t align)
+{
+  PhysicalAddress start=(count==1 && align==PageSize)?page_cache_allocate():physical_pages.allocate(count,align);
+  if (start==0) panic("Out of hosted physical memory: ",count);
+  __builtin_memset((void *)start,0xCC,count*PageSize); // UEFI doesn't zero pages either
+  return start;
+}
+
+bool AllocatePagesAt(PhysicalAddress base,uint64_t count)
+{
+  if (!physical_pages.allocate_at(base,count)) return false;
+  __builtin_memset((void *)base,0xCC,count*PageSize);
+  return true;
+}
+
+void DeallocatePages(PhysicalAddress base,uint64_t count)
+{
+  madvise((void *)base,count*PageSize,MADV_DONTNEED);
+  if (count==1) page_cache_free(base);
+  else physical_pages.free(base,count);
+}
+
+
+/* Timing and memory use */
+double time_now(void) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Resident set size now, in KB (from /proc/self/statm)
+long rss_KB(void) {
+  long pages=0, resident=0;
+  FILE *f=fopen("/proc/self/statm","r");
+  if (f) { if (fscanf(f,"%ld %ld",&pages,&resident)!=2) resident=0; fclose(f); }
+  return resident*4; // 4KB pages
+}
+
+// Peak resident set size, in KB
+long peak_rss_KB(void) {
+  struct rusage u;
+  getrusage(RUSAGE_SELF,&u);
+  return u.ru_maxrss;
+}
+
+void report(const char *name,double ops,double start) {
+  double t=time_now()-start;
+  printf("%-36s %8.2f Mops/sec  %7.3f sec  RSS %6ld KB\n",name,ops/t*1.0e-6,t,rss_KB());
+}
+
+
+/* Check that a fresh block is zeroed, then scribble on it
+   (so a missed zeroing shows up in the next user). */
+void check_and_fill(void *ptr,uint64_t size,unsigned char fill) {
+  unsigned char *p=(unsigned char *)ptr;
+  if (size==0) size=1;
+  if (p[0]!=0 || p[size-1]!=0 || p[size/2]!=0) panic("galloc returned non-zeroed memory at ",(uint64_t)ptr);
+  p[0]=fill; p[size/2]=fill; p[size-1]=fill;
+}
+
+// Small fast deterministic random numbers (xorshift)
+struct random_sizes {
+  uint64_t x;
+  random_sizes(uint64_t seed) :x(seed*0x9E3779B97F4A7C15ull+1) {}
+  uint64_t next(void) { x^=x<<13; x^=x>>7; x^=x<<17; return x; }
+  // Mostly small sizes, like a real program: 8 bytes to about 4KB
+  uint64_t size(void) { return 8+(next()%(1u<<(3+next()%10))); }
+};
+
+int nthreads=4;
+
+template <class FN>
+void run_threads(int n,FN fn) {
+  std::vector<std::thread> threads;
+  for (int t=0;t<n;t++) threads.emplace_back(fn,t);
+  for (auto &t:threads) t.join();
+}
+
+
+/* Allocate and free one size over and over: the magazine fast path */
+void size_sweep(void)
+{
+  for (uint64_t size=8;size<=MAX_REGION_SIZE;size=size*5/4+8)
+  {
+    int n=200000;
+    if (size>4096) n=(n*4096/size+16)&~15; // big blocks get zeroed on each reuse
+    double start=time_now();
+    void *ptrs[16];
+    for (int i=0;i<n;i+=16) {
+      for (int k=0;k<16;k++) { ptrs[k]=galloc(size); *(char *)ptrs[k]=1; }
+      for (int k=0;k<16;k++) gfree(ptrs[k]);
+    }
+    char name[100]; snprintf(name,sizeof(name),"size sweep %ld bytes",(long)size);
+    report(name,2.0*n,start);
+  }
+
+  // Large allocations, like framebuffers
+  double start=time_now();
+  const int nlarge=20;
+  for (int i=0;i<nlarge;i++) {
+    uint64_t size=33177600; // 3840x2160x4
+    void *p=galloc(size);
+    check_and_fill(p,size,1);
+    gfree(p);
+  }
+  report("size sweep 33MB",2.0*nlarge,start);
+}
+
+/* Each thread allocates and frees its own random sizes */
+void threads_private(int nthreads)
+{
+  const int n=400000, live=1000;
+  double start=time_now();
+  run_threads(nthreads,[&](int t) {
+    random_sizes rs(t);
+    std::vector<void *> ptrs(live,nullptr);
+    std::vector<uint64_t> sizes(live,0);
+    for (int i=0;i<n;i++) {
+      int k=rs.next()%live;
+      gfree(ptrs[k]);
+      sizes[k]=rs.size();
+      ptrs[k]=galloc(sizes[k]);
+      check_and_fill(ptrs[k],sizes[k],t);
+    }
+    for (void *p:ptrs) gfree(p);
+  });
+  char name[100]; snprintf(name,sizeof(name),"private alloc/free x%d threads",nthreads);
+  report(name,2.0*n*nthreads,start);
+}
+
+/* Producer threads allocate, consumer threads free (every block crosses cores) */
+void producer_consumer(int nthreads)
+{
+  const int n=400000, batch=64;
+  int pairs=nthreads/2; if (pairs<1) pairs=1;
+  std::mutex lock;
+  std::deque<std::vector<void *>> queue;
+  int producers_left=pairs;
+
+  double start=time_now();
+  run_threads(2*pairs,[&](int t) {
+    if (t<pairs)
+    { // producer
+      random_sizes rs(t);
+      std::vector<void *> b;
+      for (int i=0;i<n;i++) {
+        uint64_t size=rs.size();
+        void *p=galloc(size);
+        check_and_fill(p,size,t);
+        b.push_back(p);
+        if (b.size()==batch) {
+          std::lock_guard<std::mutex> g(lock);
+          queue.push_back(std::move(b));
+          b.clear();
+        }
+      }
+      std::lock_guard<std::mutex> g(lock);
+      queue.push_back(std::move(b));
+      producers_left--;
+    }
+    else
+    { // consumer
+      while (true) {
+        std::vector<void *> b;
+        {
+          std::lock_guard<std::mutex> g(lock);
+          if (queue.empty()) {
+            if (producers_left==0) return;
+          }
+          else { b=std::move(queue.front()); queue.pop_front(); }
+        }
+        if (b.empty()) std::this_thread::yield();
+        for (void *p:b) gfree(p);
+      }
+    }
+  });
+  char name[100]; snprintf(name,sizeof(name),"producer/consumer x%d threads",2*pairs);
+  report(name,2.0*n*pairs,start);
+}
+
+/* Larson-style server churn: each round's threads inherit the previous
+   round's live blocks, so most frees are of blocks from another thread. */
+void larson(int nthreads)
+{
+  const int rounds=8, n=100000, live=2000;
+  std::vector<std::vector<void *>> slots(nthreads,std::vector<void *>(live,nullptr));
+  double start=time_now();
+  for (int round=0;round<rounds;round++) {
+    run_threads(nthreads,[&](int t) {
+      random_sizes rs(round*1000+t);
+      std::vector<void *> &mine=slots[(t+round)%nthreads]; // somebody else's last round
+      for (int i=0;i<n;i++) {
+        int k=rs.next()%live;
+        gfree(mine[k]);
+        uint64_t size=rs.size();
+        mine[k]=galloc(size);
+        check_and_fill(mine[k],size,t);
+      }
+    });
+  }
+  for (auto &s:slots) for (void *p:s) gfree(p);
+  char name[100]; snprintf(name,sizeof(name),"larson churn x%d threads",nthreads);
+  report(name,2.0*n*nthreads*rounds,start);
+}
+
+
+/* Per-frame temporaries, like WindowManager::drawAllWindows: 
+   a vector built and thrown away every frame, via new/delete vs an ArenaScope */
+template <class Alloc>
+void build_frame(int f)
+{
+  const int windows=20;
+  vector<int *,Alloc> reorder;
+  for (int w=0;w<windows;w++) reorder.push_back(&f);
+  if (reorder.size()!=windows || reorder[windows-1]!=&f) panic("vector broken in frame ",f);
+}
+
+template <class Alloc>
+void frame_temporaries(const char *name,Arena *arena)
+{
+  const int frames=200000;
+  double start=time_now();
+  for (int f=0;f<frames;f++) {
+    if (arena) {
+      ArenaScope scope(*arena);
+      build_frame<Alloc>(f);
+    }
+    else build_frame<Alloc>(f);
+  }
+  report(name,(double)frames,start);
+}
+
+void arena_tests(void)
+{
+  Arena arena;
+  frame_temporaries<NewAllocator>("frame vector, new/delete",0);
+  frame_temporaries<ArenaAllocator>("frame vector, ArenaScope",&arena);
+
+  // Nested scopes rewind to their own start, and big scratch gets trimmed
+  {
+    ArenaScope outer(arena);
+    char *a=(char *)arena.allocate(100);
+    {
+      ArenaScope inner(arena);
+      arena.allocate(10*ARENA_KEEP);
+      char *b=(char *)arena.reallocate(0,0,1000);
+      b=(char *)arena.reallocate(b,1000,2000); //<- in place, b was last
+      if (!arena.owns(b)) panic("arena lost block ",(uint64_t)b);
+    }
+    if (arena.allocate(100)!=a+112) panic("nested ArenaScope didn't rewind ",(uint64_t)a);
+  }
+  if (!arena.empty()) panic("ArenaScope didn't rewind arena",0);
+}
+
+/* Typed object pools: alignment, reuse, and new/delete through Pooled */
+struct pool_page { uint64_t entry[512]; };
+struct pooled_thing : public Pooled<pooled_thing> { int x[5]; };
+
+void pool_tests(void)
+{
+  ObjectPool<pool_page,PageSize> pages;
+  std::vector<pool_page *> v;
+  double start=time_now();
+  for (int round=0;round<100;round++) {
+    for (int i=0;i<100;i++) {
+      pool_page *p=pages.allocate();
+      if ((uint64_t)p%PageSize!=0) panic("ObjectPool page misaligned ",(uint64_t)p);
+      for (int e=0;e<512;e+=64) if (p->entry[e]!=0) panic("ObjectPool page not empty ",(uint64_t)p);
+      p->entry[round%512]=1;
+      v.push_back(p);
+    }
+    for (pool_page *p:v) { p->entry[round%512]=0; pages.deallocate(p); } //<- freed empty
+    v.clear();
+  }
+  report("ObjectPool 4KB pages",2.0*100*100,start);
+  if (pages.count_in_use()!=0 || pages.bytes_held()>100*PageSize+POOL_SLAB) panic("ObjectPool leaks ",pages.bytes_held());
+
+  pooled_thing *a=new pooled_thing, *b=new pooled_thing;
+  if ((uint64_t)a%64!=0 || (uint64_t)b%64!=0 || b==a) panic("Pooled objects misaligned ",(uint64_t)a);
+  delete a;
+  if (new pooled_thing!=a) panic("Pooled didn't reuse object ",(uint64_t)a);
+  if (Pooled<pooled_thing>::pool.count_in_use()!=2) panic("Pooled count wrong ",0);
+}
+
+/* galloc_aligned and aligned new */
+struct alignas(256) aligned_thing { char c[300]; };
+
+void aligned_tests(void)
+{
+  uint64_t sizes[]={1,24,100,4000,5000,70000,300000};
+  uint64_t aligns[]={8,16,32,64,4096,65536,4ull<<20};
+  int64_t large_live=0; // galloc_large allocs minus frees, across cores
+  for (int cpu=0;cpu<MAX_CPUS;cpu++) 
+    large_live+=galloc_caches[cpu][NUM_REGIONS-1].allocs-galloc_caches[cpu][NUM_REGIONS-1].frees;
+  for (uint64_t size:sizes) for (uint64_t align:aligns) {
+    void *p=galloc_aligned(size,align);
+    if ((uint64_t)p%align!=0) panic("galloc_aligned misaligned for align ",align);
+    if (galloc_usable_size(p)<size) panic("galloc_aligned too small for size ",size);
+    check_and_fill(p,size,1);
+    gfree(p);
+  }
+  for (int cpu=0;cpu<MAX_CPUS;cpu++) 
+    large_live-=galloc_caches[cpu][NUM_REGIONS-1].allocs-galloc_caches[cpu][NUM_REGIONS-1].frees;
+  if (large_live!=0) panic("galloc_aligned large allocs and frees don't match: ",large_live);
+  aligned_thing *t=new aligned_thing[3];
+  if ((uint64_t)t%alignof(aligned_thing)!=0) panic("aligned new misaligned ",(uint64_t)t);
+  delete[] t;
+  println("galloc_aligned OK");
+}
+
+/* Physical page allocator: blocks never overlap, stay aligned,
+   and everything merges back together when freed. */
+void buddy_tests(void)
+{
+  std::vector<std::pair<PhysicalAddress,uint64_t> > live;
+  live.reserve(1000); // so galloc doesn't take pages during the test
+  uint64_t free_start=physical_pages.free_pages();
+  uint64_t huge_start=physical_pages.free_blocks(BUDDY_MAX_ORDER);
+  random_sizes r(1);
+  double start=time_now();
+  const int n=200000;
+  for (int i=0;i<n;i++) {
+    if (live.size()<1000 && (live.empty() || r.next()%3!=0)) {
+      uint64_t count=1+r.next()%(1+(r.next()%4==0?1000:7));
+      uint64_t align=PageSize<<(r.next()%16==0?9:0);
+      PhysicalAddress p=physical_pages.allocate(count,align);
+      if (p==0 || (p&(align-1))) panic("buddy allocate misaligned: ",p);
+      *(uint64_t *)p=p; *(uint64_t *)(p+(count-1)*PageSize)=p; // overlaps would clobber these
+      live.push_back(std::make_pair(p,count));
+    }
+    else {
+      uint64_t k=r.next()%live.size();
+      PhysicalAddress p=live[k].first;
+      uint64_t count=live[k].second;
+      if (*(uint64_t *)p!=p || *(uint64_t *)(p+(count-1)*PageSize)!=p)
+        panic("buddy blocks overlap at ",p);
+      if (count>1 && r.next()%2) { // free the tail, then try to grow back into it
+        physical_pages.free(p+PageSize,count-1);
+        if (!physical_pages.allocate_at(p+PageSize,count-1))
+          panic("buddy allocate_at failed on just-freed pages at ",p);
+        *(uint64_t *)(p+(count-1)*PageSize)=p;
+      }
+      physical_pages.free(p,count);
+      live[k]=live.back(); live.pop_back();
+    }
+  }
+  for (auto &b:live) physical_pages.free(b.first,b.second);
+  report("buddy random pages",n,start);
+
+  if (physical_pages.free_pages()!=free_start || physical_pages.free_blocks(BUDDY_MAX_ORDER)!=huge_start)
+    panic("buddy didn't merge freed blocks back together, free pages=",physical_pages.free_pages());
+  PhysicalAddress p=physical_pages.allocate(1);
+  if (physical_pages.allocate_at(p,1)) panic("buddy allocate_at of in-use page: ",p);
+  
+  // Copy-on-write reference counts: only the last unshare frees it
+  physical_pages.share(p); physical_pages.share(p);
+  if (physical_pages.sharers(p)!=2) panic("buddy share count wrong: ",physical_pages.sharers(p));
+  if (physical_pages.unshare(p) || physical_pages.unshare(p)) panic("buddy unshare freed a shared page: ",p);
+  if (!physical_pages.unshare(p)) panic("buddy unshare didn't free the last reference: ",p);
+  physical_pages.free(p,1);
+}
+
+
+/* Every core allocates and frees single pages, in bursts like page faults.
+   Most of these should come from the core's own page cache. */
+void page_cache_tests(int nthreads)
+{
+  const int n=1000000, burst=100;
+  double start=time_now();
+  run_threads(nthreads,[&](int t) {
+    PhysicalAddress pages[burst];
+    for (int i=0;i<n/burst;i++) {
+      for (int b=0;b<burst;b++) {
+        pages[b]=page_cache_allocate();
+        if (pages[b]==0) panic("page cache out of memory",b);
+        *(uint64_t *)pages[b]=pages[b]+t; // a page handed out twice would clobber this
+      }
+      for (int b=0;b<burst;b++) {
+        if (*(uint64_t *)pages[b]!=pages[b]+t) panic("page cache handed out a page twice: ",pages[b]);
+        page_cache_free(pages[b]);
+      }
+    }
+  });
+  report("page cache alloc/free",2.0*n*nthreads,start);
+
+  uint64_t hits=0, misses=0;
+  for (int cpu=0;cpu<MAX_CPUS;cpu++) { hits+=page_caches[cpu].hits; misses+=page_caches[cpu].misses; }
+  if (misses*10>hits) panic("page cache missed too often, misses=",misses);
+}
+
+
+int main(int argc,char *argv[]) {
+  void *phys=mmap((void *)phys_base,phys_size,PROT_READ|PROT_WRITE,
+     MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED_NOREPLACE|MAP_NORESERVE,-1,0);
+  if (phys!=(void *)phys_base) { perror("mmap of hosted physical memory"); return 1; }
+  setup_physical_memory();
+  buddy_tests();
+
+  nthreads=std::thread::hardware_concurrency();
+  if (argc>1) nthreads=atoi(argv[1]);
+  if (nthreads<2) nthreads=2;
+  if (nthreads>MAX_CPUS/2) nthreads=MAX_CPUS/2;
+
+  // An idle "core" scrubs freed blocks in the background, like the kernel's idle loop
+  bool done=false;
+  std::thread scrubber([&]() {
+    while (!__atomic_load_n(&done,__ATOMIC_RELAXED))
+      if (galloc_background_zero(1024*1024)==0) std::this_thread::yield();
+  });
+
+  size_sweep();
+  threads_private(1);
+  threads_private(nthreads);
+  producer_consumer(nthreads);
+  larson(nthreads);
+  arena_tests();
+  pool_tests();
+  aligned_tests();
+  page_cache_tests(nthreads);
+
+  __atomic_store_n(&done,true,__ATOMIC_RELAXED);
+  scrubber.join();
+
+  print_galloc_stats();
+  print_galloc_fragmentation();
+  physical_pages.print_stats();
+  print_page_cache_stats();
+  printf("Peak RSS: %ld KB\n",peak_rss_KB());
+  println("galloc tests passed");
+  return 0;
+}
@@ -29,15 +29,6 @@ public:
     }
 };
 
-// Lock on creation, unlock on destruction.
-template <class Mutex>
-class lock_guard {
-public:
-    Mutex &l;
-    lock_guard(Mutex &l_) :l(l_) { l.lock(); }
-    ~lock_guard() { l.unlock(); }
-};
-
 TerribleLock printLock;
 
 // This function gets run to print info about each core.
@@ -52,6 +43,24 @@ void printCore(void *ignored)
 }
 
 
+/// Every procedure we run on another core starts here,
+///  so that core gets its PerCPU data set up before it does anything else.
+struct AP_call {
+    EFI_AP_PROCEDURE f; // function to run
+    void *arg; // argument to pass it
+};
+void run_on_AP(void *call_)
+{
+    setup_CPU();
+    setup_paging();
+    setup_GDT(); // so this core can run user code
+    AP_call *call=(AP_call *)call_;
+    call->f(call->arg);
+    // UEFI parks this core with interrupts off, where it can't answer
+    //   TLB shootdowns, so it mustn't be running anybody's PageTable.
+    if (this_cpu()->pagetable) PageTable::deactivate();
+}
+
 /* Manages thread startup on multiple cores */
 class MulticoreHardware {
 public:
@@ -74,16 +83,28 @@ public:
         for (int core=1;core<nenabled;core++)
         {
             print("Core "); print(core);
-            mp->StartupThisAP(mp, printCore, core,
-                0,0,0,0);
+            startupThisAP(core,printCore,0);
         }
     }
     
     // Run code on all cores at once:
     void testCores() {
         print("All cores at once: ");
-        mp->StartupAllAPs(mp, printCore, false,
-            0,0,0,0);
+        startupAllAPs(printCore,0);
+    }
+    
+    /// Run this function on this core, and wait for it to finish.
+    void startupThisAP(int core,EFI_AP_PROCEDURE f,void *arg) {
+        AP_call call={f,arg};
+        mp->StartupThisAP(mp, run_on_AP, core,
+            0,0,&call,0);
+    }
+    
+    /// Run this function on all the other cores at once, and wait for them.
+    void startupAllAPs(EFI_AP_PROCEDURE f,void *arg) {
+        AP_call call={f,arg};
+        mp->StartupAllAPs(mp, run_on_AP, false,
+            0,0,&call,0);
     }
 
 private:
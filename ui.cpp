@@ -149,6 +149,9 @@ bool UserEventSource::waitForEvent(int delayMS,UserEventHandler &handler)
         timer // timer is event 1
     };
     
+    // Scrub some freed memory before we go idle
+    galloc_background_zero(1024*1024);
+    
     UINTN index=0;
     UEFI_CHECK(ST->BootServices->WaitForEvent(nEvent,events,&index));
     
@@ -59,17 +59,91 @@ void *calloc(size_t nmemb, size_t size)
 }
 void *realloc(void *ptr, size_t size)
 {
+    if (ptr==0) return malloc(size);
+    
+    // If it still fits (and isn't wasting most of the block), keep it.
+    //   lodepng grows its vectors this way during every inflate.
+    uint64_t old_size=galloc_usable_size(ptr);
+    if (size<=old_size && size*2>old_size) return ptr;
+    
+    // Big blocks can grow or shrink by adding or removing pages at the end
+    if (region_for_pointer(ptr)>MAX_REGION && size>MAX_REGION_SIZE
+        && galloc_large_resize(ptr,size)) return ptr;
+    
     void *next=malloc(size);
-    if (ptr!=0) { // copy old data
-        memcpy(next,ptr,size); //<- FIXME: data leak (or even crash!) if new size bigger than old ptr size!
-        free(ptr);
-    }
+    memcpy(next,ptr,size<old_size?size:old_size);
+    free(ptr);
     return next;
 }
 #include "string.h"
+
+/* Memory copy and fill.  The assembly versions are in util_asm.s, and
+   setup_memory_functions picks the fastest ones for this CPU at boot.
+   (These can't be C loops: the compiler turns those back into memcpy calls!) */
+extern "C" {
+typedef void *(*memcpy_function)(void *dest, const void *src, size_t n);
+typedef void *(*memset_function)(void *dest, int value, size_t n);
+void *memcpy_rep_movsb(void *dest, const void *src, size_t n);
+void *memcpy_rep_movsq(void *dest, const void *src, size_t n);
+void *memcpy_avx2(void *dest, const void *src, size_t n);
+void *memcpy_nontemporal(void *dest, const void *src, size_t n);
+void *memcpy_backward(void *dest, const void *src, size_t n);
+void *memset_rep_stosb(void *dest, int value, size_t n);
+void *memset_rep_stosq(void *dest, int value, size_t n);
+void *memset_avx2(void *dest, int value, size_t n);
+void *memset_nontemporal(void *dest, int value, size_t n);
+}
+
+/// Copies and fills at least this big bypass the cache (non-temporal stores),
+///   so a framebuffer copy doesn't flush everything else out of cache.
+enum {NONTEMPORAL_BYTES=4*1024*1024};
+
+/// The memory functions in use (defaults work on any x86-64)
+struct MemoryFunctions {
+    memcpy_function copy; // for small and medium copies
+    memset_function set; // for small and medium fills
+    const char *name; // human-readable name
+};
+static MemoryFunctions memory_functions={memcpy_rep_movsq,memset_rep_stosq,"rep movsq"};
+
+void setup_memory_functions(void)
+{
+    detect_CPU_features();
+    if (cpu_features.erms || cpu_features.fsrm) {
+        memory_functions.copy=memcpy_rep_movsb;
+        memory_functions.set=memset_rep_stosb;
+        memory_functions.name=cpu_features.fsrm?"rep movsb (FSRM)":"rep movsb (ERMS)";
+    }
+    else if (cpu_features.avx2) {
+        memory_functions.copy=memcpy_avx2;
+        memory_functions.set=memset_avx2;
+        memory_functions.name="AVX2";
+    }
+}
+
+void print_memory_functions(void)
+{
+    print("memcpy/memset: "); print(memory_functions.name);
+    print(", non-temporal at "); print((int64_t)NONTEMPORAL_BYTES); println(" bytes");
+}
+
 void *memcpy(void *dest, const void *src, size_t n)
 {
-    return __builtin_memcpy(dest,src,n);
+    if (n>=NONTEMPORAL_BYTES) return memcpy_nontemporal(dest,src,n);
+    return memory_functions.copy(dest,src,n);
+}
+
+void *memmove(void *dest, const void *src, size_t n)
+{
+    // Copying forward is safe unless dest starts inside src
+    if ((uint64_t)dest-(uint64_t)src>=n) return memcpy(dest,src,n);
+    return memcpy_backward(dest,src,n);
+}
+
+void *memset(void *dest, int value, size_t n)
+{
+    if (n>=NONTEMPORAL_BYTES) return memset_nontemporal(dest,value,n);
+    return memory_functions.set(dest,value,n);
 }
 
 int strcmp(const char *s1, const char *s2)
@@ -259,7 +333,17 @@ void hook_interrupt(int interrupt_number,uint64_t code_address)
     amd64_descriptor idt;
     sidt(&idt);
     amd64_idt_entry *table=(amd64_idt_entry *)idt.address;
-    table[interrupt_number].set_address(code_address);
+    amd64_idt_entry &e=table[interrupt_number];
+    if (!e.P) { // UEFI didn't set this one up: make it an interrupt gate like the others
+        e.segment=table[0].segment;
+        e.ist=0;
+        e.type=0xE;
+        e.Z=0;
+        e.dpl=0;
+        e.P=1;
+        e.zero=0;
+    }
+    e.set_address(code_address);
     lidt(&idt);
 }
 
@@ -336,6 +420,19 @@ void handle_PF(void)
 {
     handle_generic_CPU_error("#PF","Page table fault\n");
 }
+
+/// Called by page_fault_entry (in util_asm.s) when an access faults.
+///  Returns only if the address space's fault handler mapped the page.
+extern "C" void handle_page_fault(VirtualAddress addr,uint64_t error,uint64_t code)
+{
+    PageTable *pagetable=this_cpu()->pagetable;
+    if (pagetable && pagetable->handle_page_fault(addr,error)) return;
+    
+    print("Page fault accessing "); print(addr);
+    print(" error code "); print(error);
+    print(" from code at "); print(code); println();
+    handle_PF();
+}
 void handle_MF(void)
 {
     handle_generic_CPU_error("#MF","Float exception on x87\n");
@@ -367,35 +464,65 @@ void handle_intC0(void)
     hang();
 }
 
-/// Configure the Global Descriptor Table at OS boot
+extern "C" void ltr(uint64_t selector); //< in util_asm.s
+
+/// Configure this core's Global Descriptor Table and Task State Segment.
+///   Call once on each core (after setup_CPU), before it runs user code.
 void setup_GDT(void)
 {
+    PerCPU *cpu=this_cpu();
+    
     // Grab the existing GDT
     amd64_descriptor gdt;
     sgdt(&gdt);
+    if (gdt.address==(uint64_t)cpu->gdt) return; // already set up this core
+    amd64_segment_descriptor *uefi=(amd64_segment_descriptor *)gdt.address;
+    uint64_t count=(gdt.sizeminus+1)/sizeof(amd64_segment_descriptor);
     
     /*
      Standard UEFI puts code at segment descriptor 0x38.
-     syscall STAR MSR expects a data segment at code segment +8.
-     So we need to write a segment at 0x40.
+     syscall STAR MSR expects a data segment at code segment +8,
+     and sysret expects user data then user code at its base +8 and +16.
+     So each core gets its own copy of UEFI's GDT, extended with:
     */
-    // Existing data segment, set up by UEFI:
-    amd64_segment_descriptor *seg30=(amd64_segment_descriptor *)(gdt.address+0x30);
-    // Unused space after the code segment:
-    amd64_segment_descriptor *seg40=(amd64_segment_descriptor *)(gdt.address+0x40);
+    amd64_segment_descriptor *seg=(amd64_segment_descriptor *)cpu->gdt;
+    for (uint64_t i=0;i<GDT_ENTRIES;i++) cpu->gdt[i]=0;
+    if (count>SEGMENT_SYSRET_BASE/8) count=SEGMENT_SYSRET_BASE/8;
+    for (uint64_t i=0;i<count;i++) seg[i]=uefi[i];
     
-    if (seg30->P==1 && seg40->P==0)
-    { // copy existing data segment into unused entry
-        *seg40 = *seg30;
+    amd64_segment_descriptor &data=seg[0x30/8], &code=seg[SEGMENT_KERNEL_CODE/8];
+    if (data.P==1 && code.P==1 && code.L==1 && seg[SEGMENT_KERNEL_DATA/8].P==0)
+    { 
+        seg[SEGMENT_KERNEL_DATA/8] = data; // copy existing data segment
+        seg[SEGMENT_USER_DATA/8] = data; seg[SEGMENT_USER_DATA/8].dpl=3;
+        seg[SEGMENT_USER_CODE/8] = code; seg[SEGMENT_USER_CODE/8].dpl=3;
     }
     else {
         print("GDT Warning: segments not where expected, expect failures.\n");
     }
     
+    // The TSS descriptor takes two entries, to hold a 64-bit base address
+    TaskStateSegment *tss=&cpu->tss_data;
+    tss->iomap_base=sizeof(TaskStateSegment); // no I/O bitmap
+    uint64_t base=(uint64_t)tss, limit=sizeof(TaskStateSegment)-1;
+    cpu->gdt[SEGMENT_TSS/8] = (limit&0xFFFF) | ((base&0xFFFFFF)<<16)
+        | (0x89ull<<40) // present, ring 0, type 9 (available 64-bit TSS)
+        | ((limit>>16)<<48) | ((base>>24&0xFF)<<56);
+    cpu->gdt[SEGMENT_TSS/8+1] = base>>32;
+    cpu->tss=tss;
+    
+    gdt.address=(uint64_t)cpu->gdt;
+    gdt.sizeminus=sizeof(cpu->gdt)-1;
     lgdt(&gdt);
-    print(" gdt ");
+    ltr(SEGMENT_TSS);
 }
 
+extern "C" void page_fault_entry(void); //< in util_asm.s
+
+/// Interrupt vector for TLB shootdown IPIs
+enum {TLB_SHOOTDOWN_VECTOR=0xF0};
+extern "C" void TLB_shootdown_entry(void); //< in util_asm.s
+
 /// Configure the Interrupt Descriptor Table at OS boot.
 ///  These print nice error messages when things go wrong.
 void setup_IDT(void)
@@ -413,13 +540,14 @@ void setup_IDT(void)
     hook_interrupt(0xB,(uint64_t)handle_NP);
     hook_interrupt(0xC,(uint64_t)handle_SS);
     hook_interrupt(0xD,(uint64_t)handle_GP);
-    hook_interrupt(0xE,(uint64_t)handle_PF);
+    hook_interrupt(0xE,(uint64_t)page_fault_entry);
     hook_interrupt(0x10,(uint64_t)handle_MF);
     hook_interrupt(0x11,(uint64_t)handle_AC);
     hook_interrupt(0x12,(uint64_t)handle_MC);
     hook_interrupt(0x13,(uint64_t)handle_XM);
     hook_interrupt(0x14,(uint64_t)handle_VE);
     hook_interrupt(0x1E,(uint64_t)handle_SX);
+    hook_interrupt(TLB_SHOOTDOWN_VECTOR,(uint64_t)TLB_shootdown_entry);
     print(" idt ");
 }
 
@@ -455,6 +583,152 @@ void test_gdt(void)
 }
 
 
+/******* Physical memory *********/
+/// All the physical memory we manage (everything UEFI said was free at boot)
+PageBuddy physical_pages;
+
+/// Leave UEFI this much free memory, for its own allocations before ExitBootServices
+enum {FIRMWARE_RESERVE=16*1024*1024};
+
+/// A snapshot of the UEFI memory map (see the 'm' command)
+struct UEFI_memory_map {
+    EFI_MEMORY_DESCRIPTOR *md; // from UEFI's pool, sized to fit the map
+    UINTN md_size, key, ds;
+    UINT32 dv;
+    
+    UEFI_memory_map() {
+        md=0; md_size=0;
+        key=ds=0; dv=0;
+        // The first call just tells us the size.  Allocating our buffer 
+        //   can split a free area, so leave room for a few more descriptors.
+        while (true) {
+            UINT64 err=ST->BootServices->GetMemoryMap(&md_size,md,&key,&ds,&dv);
+            if (err!=EFI_BUFFER_TOO_SMALL) { UEFI_CHECK(err); break; }
+            if (md) ST->BootServices->FreePool(md);
+            md_size+=8*(ds?ds:sizeof(EFI_MEMORY_DESCRIPTOR));
+            UEFI_CHECK(ST->BootServices->AllocatePool(EfiLoaderData,md_size,(void **)&md));
+        }
+    }
+    ~UEFI_memory_map() {
+        if (md) ST->BootServices->FreePool(md);
+    }
+    
+    /// Number of descriptors
+    UINTN size(void) const { return ds?md_size/ds:0; }
+    
+    /// Return descriptor i (UEFI's descriptors may be bigger than ours)
+    EFI_MEMORY_DESCRIPTOR *operator[](UINTN i) { 
+        return (EFI_MEMORY_DESCRIPTOR *)(i*ds+(char *)md); 
+    }
+};
+
+void setup_physical_memory(void)
+{
+    UEFI_memory_map map;
+    
+    // Find the range of free memory, and the biggest free area
+    PhysicalAddress lo=~0ull, hi=0;
+    EFI_MEMORY_DESCRIPTOR *biggest=0;
+    for (UINTN i=0;i<map.size();i++) 
+    {
+        EFI_MEMORY_DESCRIPTOR *m=map[i];
+        if (m->Type!=EfiConventionalMemory) continue;
+        if (m->PhysicalStart<LOW_MEMORY) 
+        { // trim off the low part (in our copy of the map)
+            uint64_t skip=(LOW_MEMORY-m->PhysicalStart)/PageSize;
+            if (skip>m->NumberOfPages) skip=m->NumberOfPages;
+            m->PhysicalStart+=skip*PageSize;
+            m->NumberOfPages-=skip;
+        }
+        if (m->NumberOfPages==0) continue;
+        PhysicalAddress end=m->PhysicalStart+m->NumberOfPages*PageSize;
+        if (m->PhysicalStart<lo) lo=m->PhysicalStart;
+        if (end>hi) hi=end;
+        if (biggest==0 || m->NumberOfPages>biggest->NumberOfPages) biggest=m;
+    }
+    if (biggest==0) panic("No conventional memory in UEFI memory map",0);
+    
+    // Our bookkeeping goes at the start of the biggest area,
+    //   and the end of it is left for UEFI.
+    uint64_t meta_pages=(PageBuddy::meta_bytes(lo,hi)+PageSize-1)/PageSize;
+    uint64_t reserve_pages=FIRMWARE_RESERVE/PageSize;
+    if (biggest->NumberOfPages<meta_pages+2*reserve_pages) 
+        panic("Not enough memory to manage, pages=",biggest->NumberOfPages);
+    
+    // Claim the biggest area from UEFI, so it won't hand these pages out too
+    EFI_PHYSICAL_ADDRESS start=biggest->PhysicalStart;
+    uint64_t pages=biggest->NumberOfPages-reserve_pages;
+    UEFI_CHECK(ST->BootServices->AllocatePages(AllocateAddress,EfiLoaderData,pages,&start));
+    uint8_t *meta=(uint8_t *)start;
+    memset(meta,0,meta_pages*PageSize);
+    physical_pages.setup(lo,hi,meta);
+    physical_pages.add(start+meta_pages*PageSize,pages-meta_pages);
+    
+    // Claim the rest of the free areas
+    for (UINTN i=0;i<map.size();i++) 
+    {
+        EFI_MEMORY_DESCRIPTOR *m=map[i];
+        if (m->Type!=EfiConventionalMemory || m->NumberOfPages==0 || m==biggest) continue;
+        start=m->PhysicalStart;
+        pages=m->NumberOfPages;
+        if (ST->BootServices->AllocatePages(AllocateAddress,EfiLoaderData,pages,&start)!=0)
+            continue; // UEFI used part of it since GetMemoryMap: leave it to UEFI.
+        physical_pages.add(start,pages);
+    }
+}
+
+PhysicalAddress physical_memory_end(void)
+{
+    return physical_pages.end_address();
+}
+
+PhysicalAddress AllocatePages(uint64_t count,uint64_t align)
+{
+    if (count==1 && align==PageSize) return AllocatePage();
+    PhysicalAddress p=physical_pages.allocate(count,align);
+    if (p==0) panic("Out of physical memory, pages=",count);
+    return p;
+}
+
+void DeallocatePages(PhysicalAddress base,uint64_t count)
+{
+    if (count==1) DeallocatePage(base);
+    else physical_pages.free(base,count);
+}
+
+bool AllocatePagesAt(PhysicalAddress base,uint64_t count)
+{
+    return physical_pages.allocate_at(base,count);
+}
+
+PhysicalAddress AllocatePage(void)
+{
+    PhysicalAddress p=page_cache_allocate();
+    if (p==0) panic("Out of physical memory, pages=",1);
+    return p;
+}
+
+void DeallocatePage(PhysicalAddress base)
+{
+    page_cache_free(base);
+}
+
+void SharePage(PhysicalAddress page)
+{
+    physical_pages.share(page);
+}
+
+void ReleasePage(PhysicalAddress page)
+{
+    if (physical_pages.unshare(page)) DeallocatePage(page);
+}
+
+bool PageShared(PhysicalAddress page)
+{
+    return physical_pages.sharers(page)>0;
+}
+
+
 /******* Page Tables *********/
 enum {PAGE_BITS=12}; // bits per page address
 enum {PML_BITS=9}; // bits per pagemap level
@@ -558,6 +832,29 @@ struct pagemap_entry {
 // A pagetable is a pointer to the highest pagemap level (pml4 or pml5)
 typedef pagemap_entry  pagetable_t;
 
+/// One 4KB page of pagemap entries (for any level)
+struct pagemap_page {
+    pagemap_entry entry[pagemap_length];
+};
+
+/// Page-table pages come from their own pool of 4KB-aligned pages.
+///   Pages always go back in the pool empty (nothing present), 
+///   so allocating one never needs zeroing.
+ObjectPool<pagemap_page,PageSize> pagemap_pool;
+
+/// Return a new empty (all zero) pagemap
+pagemap_entry *allocate_pagemap(void)
+{
+    return pagemap_pool.allocate()->entry;
+}
+
+/// Give back this pagemap (just this level, not what it points to).
+void free_pagemap(pagemap_entry *pml)
+{
+    for (int idx=0;idx<pagemap_length;idx++) pml[idx].empty();
+    pagemap_pool.deallocate((pagemap_page *)pml);
+}
+
 extern "C" pagetable_t *read_pagetable(void); //< in util_asm.s, reads cr3 register
 extern "C" void write_pagetable(pagetable_t *new_pagetable); //< in util_asm.s, writes cr3 register
 
@@ -643,16 +940,771 @@ void print_pagetables(void)
     print("\n");
 }
 
+/******* Address spaces (class PageTable) *********/
+extern "C" void write_cr3(uint64_t cr3); //< in util_asm.s, writes cr3 including PCID bits
+extern "C" uint64_t read_cr0(void); //< in util_asm.s
+extern "C" void write_cr0(uint64_t cr0); //< in util_asm.s
+extern "C" uint64_t read_cr4(void); //< in util_asm.s
+extern "C" void write_cr4(uint64_t cr4); //< in util_asm.s
+extern "C" void invlpg(VirtualAddress addr); //< in util_asm.s, flushes one TLB entry
+extern "C" void reload_cr3(void); //< in util_asm.s, flushes this address space's TLB entries
+
+enum {CR4_PCIDE=1<<17}; // CR4 bit to turn on process-context IDs
+const uint64_t CR3_NOFLUSH=1ull<<63; // CR3 bit: keep this PCID's TLB entries
+enum {MSR_EFER=0xC0000080, EFER_NXE=1<<11}; // XD bit only works if NXE is on
+enum {CR4_PGE=1<<7}; // CR4 bit for global pages (toggling it flushes every TLB entry)
+enum {CR0_WP=1<<16}; // CR0 bit that makes read-only pages read-only for the kernel too
+enum {CR4_SMAP=1<<21}; // CR4 bit that stops the kernel touching user pages
+
+/// Page Attribute Table: the memory type for each combination of a page's
+///   PAT, PCD, and PWT bits.  We keep the power-on types for PA0-PA3 (which
+///   is all UEFI uses), and make PA5 (PAT and PWT) write-combining.
+enum {MSR_PAT=0x277};
+enum {PAT_UC=0x00, PAT_WC=0x01, PAT_WT=0x04, PAT_WB=0x06, PAT_UC_MINUS=0x07};
+const uint64_t PAT_GLADOS=
+    ((uint64_t)PAT_WB<<0) | ((uint64_t)PAT_WT<<8) | ((uint64_t)PAT_UC_MINUS<<16) | ((uint64_t)PAT_UC<<24) |
+    ((uint64_t)PAT_WB<<32) | ((uint64_t)PAT_WC<<40) | ((uint64_t)PAT_UC_MINUS<<48) | ((uint64_t)PAT_UC<<56);
+
+/// pagemap_entry.ignored bits:
+///   OWNED: this PageTable made this entry.
+///     (Entries without it are shared with the kernel's pagetable.)
+///   COW: this read-only page is really writable, but shared copy-on-write.
+enum {PAGEMAP_OWNED=1, PAGEMAP_COW=2};
+
+/// The kernel's pagetable, set up by UEFI.  It uses PCID 0.
+uint64_t kernel_cr3=0;
+/// Can we use the XD bit?
+bool nx_enabled=false;
+/// Bumped each time we edit the kernel's own pagemaps (see set_write_combining)
+uint64_t kernel_mapping_generation=0;
+
+/// Turn off interrupts, and return the old flags for restore_interrupts
+inline uint64_t save_interrupts(void) {
+    uint64_t flags;
+    __asm__ __volatile__("pushfq; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+/// Turn interrupts back on, if they were on in these flags
+inline void restore_interrupts(uint64_t flags) {
+    if (flags&(1<<9)) sti(); // IF
+}
+
+/// Flush every TLB entry on this core, including global pages and other PCIDs
+void flush_all_TLB_local(void)
+{
+    uint64_t cr4=read_cr4();
+    write_cr4(cr4^CR4_PGE);
+    write_cr4(cr4);
+}
+
+/// If the kernel's pagemaps changed since this core last looked,
+///   flush its stale copies of the kernel's mappings.
+void catch_up_kernel_mappings(void)
+{
+    PerCPU *cpu=this_cpu();
+    uint64_t gen=__atomic_load_n(&kernel_mapping_generation,__ATOMIC_SEQ_CST);
+    if (cpu->kernel_generation==gen) return;
+    flush_all_TLB_local();
+    cpu->kernel_generation=gen;
+}
+
+void setup_paging(void)
+{
+    PerCPU *cpu=this_cpu();
+    if (kernel_cr3==0) {
+        kernel_cr3=(uint64_t)read_pagetable();
+        nx_enabled=(read_msr(MSR_EFER)&EFER_NXE)!=0;
+    }
+    if (cpu_features.pcid && !cpu->pcid) {
+        write_cr3(kernel_cr3); // PCIDE needs CR3's low 12 bits to be zero
+        write_cr4(read_cr4()|CR4_PCIDE);
+        cpu->pcid=true;
+    }
+    if (read_cr4()&CR4_SMAP) {
+        // Syscalls read and write user memory directly (e.g., write's buffer)
+        write_cr4(read_cr4()&~(uint64_t)CR4_SMAP);
+    }
+    if (cpu_features.pat && read_msr(MSR_PAT)!=PAT_GLADOS) {
+        // Every core needs the same PAT, or shared pages get mixed memory types
+        write_msr(MSR_PAT,PAT_GLADOS);
+        flush_all_TLB_local(); // flush any TLB entries with the old types
+    }
+    catch_up_kernel_mappings();
+}
+
+/// PCIDs handed out to PageTables.  Only 4095 can be live at once;
+///   after that, PageTables share PCID_SHARED and flush on every switch.
+enum {PCID_COUNT=4096, PCID_SHARED=PCID_COUNT-1};
+uint64_t pcids_used[PCID_COUNT/64]={1}; // PCID 0 is the kernel's
+SpinLock pcid_lock;
+
+uint64_t allocate_pcid(void)
+{
+    lock_guard<SpinLock> guard(pcid_lock);
+    for (int w=0;w<PCID_COUNT/64;w++) 
+        if (~pcids_used[w]) {
+            int b=__builtin_ctzll(~pcids_used[w]);
+            uint64_t pcid=w*64+b;
+            if (pcid==PCID_SHARED) break;
+            pcids_used[w]|=1ull<<b;
+            return pcid;
+        }
+    return PCID_SHARED;
+}
+
+void free_pcid(uint64_t pcid)
+{
+    if (pcid==PCID_SHARED) return;
+    lock_guard<SpinLock> guard(pcid_lock);
+    pcids_used[pcid/64]&=~(1ull<<(pcid%64));
+}
+
+/// Return the number of bytes each entry maps at this pagemap level (1: PML1)
+inline uint64_t level_bytes(int level) {
+    return 1ull<<(PAGE_BITS+PML_BITS*(level-1));
+}
+
+/// Return the index into a pagemap at this level for this address
+inline int level_index(VirtualAddress v,int level) {
+    return (v>>(PAGE_BITS+PML_BITS*(level-1)))&(pagemap_length-1);
+}
+
+/// Return true if this present entry is a page (not a pointer to the next level)
+inline bool is_leaf(const pagemap_entry &e,int level) {
+    return level==1 || e.PAT;
+}
+
+/// Free this pagemap, and any lower-level pagemaps we own under it
+void free_owned_pagemaps(pagemap_entry *pml,int level)
+{
+    for (int idx=0;idx<pagemap_length;idx++) {
+        pagemap_entry &e=pml[idx];
+        if (e.present && (e.ignored&PAGEMAP_OWNED) && !is_leaf(e,level))
+            free_owned_pagemaps(e.next_level(),level-1);
+    }
+    free_pagemap(pml);
+}
+
+/// Make this page write-combining (memory type PA5 in PAT_GLADOS)
+void mark_write_combining(pagemap_entry &e,int level)
+{
+    e.PWT=1;
+    e.PCD=0;
+    if (level==1) e.PAT=1;
+    else e.address|=1; // large pages keep their PAT bit in bit 12
+}
+
+/// Fill next with the 512 smaller pages that make up this large page
+void split_large_page(const pagemap_entry &e,int level,pagemap_entry *next)
+{
+    uint64_t start=(e.address<<PAGE_BITS)&~(level_bytes(level)-1);
+    bool wc=(e.address&1); // large page's PAT bit
+    for (int idx=0;idx<pagemap_length;idx++) {
+        next[idx]=e;
+        next[idx].PAT=(level-1>1); // still a large page, unless it's a PML1
+        next[idx].set_address((void *)(start+idx*level_bytes(level-1)));
+        if (wc) mark_write_combining(next[idx],level-1);
+    }
+}
+
+/// Return the next-level pagemap under this entry, after making it ours:
+///   a shared kernel pagemap gets copied, and a large page gets split
+///   into 512 smaller pages.  Either way the mappings don't change.
+pagemap_entry *owned_next_level(pagemap_entry &e,int level)
+{
+    if (e.present && (e.ignored&PAGEMAP_OWNED)) {
+        if (!is_leaf(e,level)) return e.next_level();
+    }
+    pagemap_entry *next=allocate_pagemap();
+    if (e.present && is_leaf(e,level)) 
+    { // split this large page
+        split_large_page(e,level,next);
+    }
+    else if (e.present) 
+    { // copy the kernel's pagemap
+        pagemap_entry *shared=e.next_level();
+        for (int idx=0;idx<pagemap_length;idx++) {
+            next[idx]=shared[idx];
+            next[idx].ignored&=~PAGEMAP_OWNED;
+        }
+    }
+    
+    // Upper levels allow everything: the last level decides permissions.
+    e.empty();
+    e.present=1;
+    e.RW=1;
+    e.US=1;
+    e.ignored=PAGEMAP_OWNED;
+    e.set_address(next);
+    return next;
+}
+
+/// Make the pages from start to end write-combining, splitting large pages
+///   that stick out past either end.  The pagemaps are edited in place.
+void map_write_combining(pagemap_entry *pml,int level,VirtualAddress start,VirtualAddress end)
+{
+    uint64_t size=level_bytes(level);
+    VirtualAddress a=start&~(size-1); // start of the entry's range
+    for (int idx=level_index(start,level);idx<pagemap_length && a<end;idx++,a+=size)
+    {
+        pagemap_entry &e=pml[idx];
+        if (!e.present) continue;
+        VirtualAddress s=a>start?a:start, t=a+size<end?a+size:end; // part we're editing
+        if (is_leaf(e,level) && s==a && t==a+size) { mark_write_combining(e,level); continue; }
+        if (is_leaf(e,level)) 
+        { // replace the large page with a pagemap of smaller pages
+            pagemap_entry *next=allocate_pagemap();
+            split_large_page(e,level,next);
+            e.PAT=0;
+            e.PWT=e.PCD=0;
+            e.set_address(next);
+        }
+        map_write_combining(e.next_level(),level-1,s,t);
+    }
+}
+
+void shootdown_kernel_mappings(void);
+
+bool set_write_combining(VirtualAddress start,uint64_t bytes)
+{
+    if (!cpu_features.pat || kernel_cr3==0) return false;
+    VirtualAddress end=(start+bytes+PageSize-1)&~(uint64_t)(PageSize-1);
+    start&=~(uint64_t)(PageSize-1);
+    
+    // UEFI may have mapped its own pagemaps read-only, so 
+    //   turn off write protection while we edit them in place.
+    uint64_t flags=save_interrupts();
+    uint64_t cr0=read_cr0();
+    write_cr0(cr0&~(uint64_t)CR0_WP);
+    map_write_combining((pagemap_entry *)(kernel_cr3&~(PageSize-1)),4,start,end);
+    write_cr0(cr0);
+    __atomic_add_fetch(&kernel_mapping_generation,1,__ATOMIC_SEQ_CST);
+    catch_up_kernel_mappings();
+    restore_interrupts(flags);
+    
+    shootdown_kernel_mappings(); // other cores' TLBs have the old types too
+    return true;
+}
+
+void PageTable::make_base(void)
+{
+    pagemap_entry *pml4=allocate_pagemap();
+    pagemap_entry *kernel=(pagemap_entry *)(kernel_cr3&~(PageSize-1));
+    for (int idx=0;idx<pagemap_length;idx++) {
+        pml4[idx]=kernel[idx];
+        pml4[idx].ignored&=~PAGEMAP_OWNED;
+    }
+    base=(PhysicalAddress)pml4;
+    pcid=allocate_pcid();
+}
+
+PageTable::~PageTable()
+{
+    if (base==0) return;
+    if (this_cpu()->pagetable==this) deactivate();
+    free_owned_pagemaps((pagemap_entry *)base,4);
+    free_pcid(pcid);
+}
+
+void PageTable::add(PhysicalAddress page,VirtualAddress map,
+    SetOfPagePermissions perm)
+{
+    add_range(page,map,PageSize,perm);
+}
+
+void PageTable::add_range(PhysicalAddress page,VirtualAddress map,uint64_t bytes,
+    SetOfPagePermissions perm)
+{
+    if (base==0) make_base();
+    if ((page|map|bytes)&(PageSize-1)) panic("PageTable::add_range not page aligned: ",map);
+    
+    // Permissions for each last-level entry
+    pagemap_entry leaf;
+    leaf.empty();
+    leaf.present=1;
+    leaf.RW=perm&Writable;
+    leaf.US=perm&UserAccess;
+    leaf.XD=nx_enabled && !(perm&Executable);
+    leaf.ignored=PAGEMAP_OWNED;
+    
+    while (bytes>0) 
+    {
+        // Use the biggest page that fits here
+        int level=1;
+        for (int l=cpu_features.pdpe1gb?3:2;l>1;l--) {
+            uint64_t size=level_bytes(l);
+            if (((page|map)&(size-1))==0 && bytes>=size) { level=l; break; }
+        }
+        
+        // Walk down to that level's pagemap
+        pagemap_entry *pml=(pagemap_entry *)base;
+        for (int l=4;l>level;l--)
+            pml=owned_next_level(pml[level_index(map,l)],l);
+        
+        // Fill in entries until we run out of bytes or pagemap
+        uint64_t size=level_bytes(level);
+        for (int idx=level_index(map,level);idx<pagemap_length && bytes>=size;idx++)
+        {
+            pagemap_entry &e=pml[idx];
+            if (e.present && (e.ignored&PAGEMAP_OWNED) && !is_leaf(e,level))
+                free_owned_pagemaps(e.next_level(),level-1); // replacing smaller pages
+            bool was_present=e.present;
+            e=leaf;
+            e.PAT=(level>1);
+            e.set_address((void *)page);
+            if (was_present) invalidate(map,size); // replacing an old mapping
+            
+            page+=size; map+=size; bytes-=size;
+            if (level==1 && bytes>=level_bytes(2) && (map&(level_bytes(2)-1))==0 
+                && (page&(level_bytes(2)-1))==0) break; // big pages fit again
+        }
+    }
+    flush_TLB();
+}
+
+PhysicalAddress PageTable::lookup(VirtualAddress map)
+{
+    if (base==0) return 0;
+    pagemap_entry *pml=(pagemap_entry *)base;
+    for (int level=4;level>=1;level--) {
+        pagemap_entry &e=pml[level_index(map,level)];
+        if (!e.present || !(e.ignored&PAGEMAP_OWNED)) return 0;
+        if (is_leaf(e,level))
+            return (e.address<<PAGE_BITS)+(map&(level_bytes(level)-1));
+        pml=e.next_level();
+    }
+    return 0;
+}
+
+void PageTable::activate(void)
+{
+    if (base==0) make_base();
+    PerCPU *cpu=this_cpu();
+    uint64_t me=1ull<<cpu->index;
+    
+    // A shootdown IPI has to wait until we're really running this table.
+    //   We claim it before checking cpus_used: flush_TLB clears our bit
+    //   and then checks our pagetable, so it either IPIs us or we flush.
+    uint64_t flags=save_interrupts();
+    catch_up_kernel_mappings();
+    __atomic_store_n(&cpu->pagetable,this,__ATOMIC_SEQ_CST);
+    uint64_t used=__atomic_fetch_or(&cpus_used,me,__ATOMIC_SEQ_CST);
+    uint64_t cr3=base;
+    if (cpu->pcid) {
+        cr3|=pcid;
+        // Keep our old TLB entries, if this core has run us since we got this PCID
+        if (pcid!=PCID_SHARED && (used&me))
+            cr3|=CR3_NOFLUSH;
+    }
+    write_cr3(cr3);
+    restore_interrupts(flags);
+}
+
+void PageTable::deactivate(void)
+{
+    PerCPU *cpu=this_cpu();
+    cpu->pagetable=0;
+    write_cr3(kernel_cr3|(cpu->pcid?CR3_NOFLUSH:0));
+}
+
+/// Call fn(entry,level) on each page we added between start and end,
+///   splitting any large page that sticks out past either end.
+template <class FN>
+void edit_owned_pages(pagemap_entry *pml,int level,VirtualAddress start,VirtualAddress end,FN fn)
+{
+    uint64_t size=level_bytes(level);
+    VirtualAddress a=start&~(size-1); // start of the entry's range
+    for (int idx=level_index(start,level);idx<pagemap_length && a<end;idx++,a+=size)
+    {
+        pagemap_entry &e=pml[idx];
+        if (!e.present || !(e.ignored&PAGEMAP_OWNED)) continue; // not ours
+        VirtualAddress s=a>start?a:start, t=a+size<end?a+size:end; // part we're editing
+        if (is_leaf(e,level) && s==a && t==a+size) fn(e,level);
+        else edit_owned_pages(owned_next_level(e,level),level-1,s,t,fn);
+    }
+}
+
+void PageTable::remove_range(VirtualAddress map,uint64_t bytes)
+{
+    if ((map|bytes)&(PageSize-1)) panic("PageTable::remove_range not page aligned: ",map);
+    if (base==0) return;
+    edit_owned_pages((pagemap_entry *)base,4,map,map+bytes,
+        [](pagemap_entry &e,int level) { e.empty(); });
+    invalidate(map,bytes);
+}
+
+void PageTable::protect_range(VirtualAddress map,uint64_t bytes,SetOfPagePermissions perm)
+{
+    if ((map|bytes)&(PageSize-1)) panic("PageTable::protect_range not page aligned: ",map);
+    if (base==0) return;
+    edit_owned_pages((pagemap_entry *)base,4,map,map+bytes,
+        [perm](pagemap_entry &e,int level) {
+            if (!(perm&Writable)) e.ignored&=~PAGEMAP_COW; // still shared, but never written
+            e.RW=(perm&Writable) && !(e.ignored&PAGEMAP_COW); // copy happens on write
+            e.US=perm&UserAccess;
+            e.XD=nx_enabled && !(perm&Executable);
+        });
+    invalidate(map,bytes);
+}
+
+void PageTable::release_pages(VirtualAddress map,uint64_t bytes)
+{
+    if ((map|bytes)&(PageSize-1)) panic("PageTable::release_pages not page aligned: ",map);
+    if (base==0) return;
+    edit_owned_pages((pagemap_entry *)base,4,map,map+bytes,
+        [](pagemap_entry &e,int level) {
+            PhysicalAddress page=e.address<<PAGE_BITS;
+            for (uint64_t off=0;off<level_bytes(level);off+=PageSize)
+                ReleasePage(page+off);
+            e.empty();
+        });
+    invalidate(map,bytes);
+}
+
+void PageTable::add_shared(PhysicalAddress page,VirtualAddress map,SetOfPagePermissions perm)
+{
+    int read_only=0; // perm, minus Writable (the write fault makes our copy)
+    if (perm&Readable) read_only|=Readable;
+    if (perm&Executable) read_only|=Executable;
+    if (perm&UserAccess) read_only|=UserAccess;
+    SharePage(page);
+    add(page,map,SetOfPagePermissions(read_only));
+    if (perm&Writable) edit_owned_pages((pagemap_entry *)base,4,map,map+PageSize,
+        [](pagemap_entry &e,int level) { e.ignored|=PAGEMAP_COW; });
+}
+
+/// Share the pages we own under pml with the child's pagemap at the same spot,
+///   turning our writable pages read-only and copy-on-write in both.
+void clone_owned_pages(PageTable &parent,pagemap_entry *pml,pagemap_entry *child,
+    int level,VirtualAddress start)
+{
+    for (int idx=0;idx<pagemap_length;idx++) {
+        pagemap_entry &e=pml[idx];
+        if (!e.present || !(e.ignored&PAGEMAP_OWNED)) continue; // kernel's (child has it)
+        VirtualAddress a=start+idx*level_bytes(level);
+        if (level>1) 
+        { // walk down (reference counts are per 4KB page, so large pages get split)
+            clone_owned_pages(parent,owned_next_level(e,level),
+                owned_next_level(child[idx],level),level-1,a);
+            continue;
+        }
+        if (e.RW) {
+            e.RW=0;
+            e.ignored|=PAGEMAP_COW;
+            parent.invalidate(a,PageSize);
+        }
+        SharePage(e.address<<PAGE_BITS);
+        child[idx]=e;
+    }
+}
+
+void PageTable::clone(PageTable &child)
+{
+    if (base==0) return;
+    if (child.base==0) child.make_base();
+    clone_owned_pages(*this,(pagemap_entry *)base,(pagemap_entry *)child.base,4,0);
+    flush_TLB(); // our writable pages are read-only now
+}
+
+bool PageTable::copy_on_write(VirtualAddress addr)
+{
+    if (base==0) return false;
+    VirtualAddress map=addr&~(uint64_t)(PageSize-1);
+    pagemap_entry *pml=(pagemap_entry *)base;
+    for (int level=4;level>1;level--) {
+        pagemap_entry &e=pml[level_index(map,level)];
+        if (!e.present || !(e.ignored&PAGEMAP_OWNED) || is_leaf(e,level)) return false;
+        pml=e.next_level();
+    }
+    pagemap_entry &e=pml[level_index(map,1)];
+    if (!e.present || !(e.ignored&PAGEMAP_COW)) return false;
+    
+    PhysicalAddress page=e.address<<PAGE_BITS;
+    if (PageShared(page)) 
+    { // somebody else still has it: switch to our own copy
+        PhysicalAddress copy=AllocatePage();
+        memcpy((void *)copy,(const void *)page,PageSize);
+        e.set_address((void *)copy);
+        ReleasePage(page); // (frees it, if they let go while we copied)
+        cow_copies++;
+    }
+    e.RW=1;
+    e.ignored&=~PAGEMAP_COW;
+    invalidate(map,PageSize);
+    flush_TLB();
+    return true;
+}
+
+
+/* Local APIC, for sending interrupts to other cores (IPIs). 
+   Either memory-mapped (xAPIC) or via MSRs (x2APIC), 
+   depending on how the firmware left it. */
+enum {MSR_APIC_BASE=0x1B, APIC_BASE_X2APIC=1<<10};
+enum {APIC_EOI=0xB0, APIC_ICR_LOW=0x300, APIC_ICR_HIGH=0x310, APIC_ICR_BUSY=1<<12};
+enum {MSR_X2APIC_EOI=0x80B, MSR_X2APIC_ICR=0x830};
+
+/// Return the local APIC's memory-mapped registers, or 0 if it's in x2APIC mode.
+volatile uint32_t *local_APIC(void)
+{
+    uint64_t base=read_msr(MSR_APIC_BASE);
+    if (base&APIC_BASE_X2APIC) return 0;
+    return (volatile uint32_t *)(base&~0xFFFull);
+}
+
+/// Send this interrupt vector to the core with this APIC ID.
+void send_IPI(uint64_t apic_id,int vector)
+{
+    volatile uint32_t *apic=local_APIC();
+    if (apic==0) write_msr(MSR_X2APIC_ICR,(apic_id<<32)|vector);
+    else {
+        while (apic[APIC_ICR_LOW/4]&APIC_ICR_BUSY) pause_CPU();
+        apic[APIC_ICR_HIGH/4]=apic_id<<24;
+        apic[APIC_ICR_LOW/4]=vector; // fixed delivery, physical destination
+    }
+}
+
+/// Tell the local APIC we're done with its interrupt.
+void APIC_end_of_interrupt(void)
+{
+    volatile uint32_t *apic=local_APIC();
+    if (apic==0) write_msr(MSR_X2APIC_EOI,0);
+    else apic[APIC_EOI/4]=0;
+}
+
+
+/* TLB shootdown: when one core changes a pagetable, other cores running
+   it might still have the old entries cached in their TLB. */
+
+/// Each core's inbox for shootdown requests
+struct TLB_mailbox {
+    int pending; // 1 while the sender waits for us
+    PageTable *pagetable; // address space to flush
+    TLBBatch batch; // what to flush
+};
+TLB_mailbox TLB_mailboxes[MAX_CPUS];
+SpinLock shootdown_lock; // one shootdown at a time uses the mailboxes
+
+/// Counts for print_TLB_stats
+struct TLB_counts {
+    uint64_t flushes; // calls to flush_TLB with something to flush
+    uint64_t invlpg_pages; // pages flushed one at a time, on any core
+    uint64_t full_flushes; // whole-address-space flushes, on any core
+    uint64_t ipis; // shootdown IPIs sent
+    uint64_t lazy; // cores that ran the address space, but aren't now
+    uint64_t skipped; // cores that never ran the address space
+    uint64_t cycles; // total time in flush_TLB
+} TLB_stats;
+
+/// Flush this batch from this core's TLB (it must be running the address space)
+void flush_TLB_local(const TLBBatch &batch)
+{
+    if (batch.full_flush()) {
+        reload_cr3();
+        __atomic_fetch_add(&TLB_stats.full_flushes,1,__ATOMIC_RELAXED);
+    }
+    else {
+        for (int r=0;r<batch.count;r++)
+            for (uint64_t off=0;off<batch.bytes[r];off+=PageSize)
+                invlpg(batch.start[r]+off);
+        __atomic_fetch_add(&TLB_stats.invlpg_pages,batch.pages,__ATOMIC_RELAXED);
+    }
+}
+
+/// Do the shootdown another core asked of us, if there is one.
+///   The IPI handler calls this, and so does flush_TLB while it spins:
+///   page faults run with interrupts off, so the IPI can't get in.
+void service_TLB_shootdown(void)
+{
+    TLB_mailbox &m=TLB_mailboxes[cpu_index()];
+    if (!__atomic_load_n(&m.pending,__ATOMIC_ACQUIRE)) return; // (already done)
+    catch_up_kernel_mappings(); // (the whole request, if m.pagetable is 0)
+    // If we switched away since the IPI was sent, our cpus_used bit 
+    //   is already clear, so we'll flush when we switch back.
+    if (m.pagetable && this_cpu()->pagetable==m.pagetable) flush_TLB_local(m.batch);
+    __atomic_store_n(&m.pending,0,__ATOMIC_RELEASE);
+}
+
+/// Runs on a core that got a shootdown IPI (via TLB_shootdown_entry)
+extern "C" void handle_TLB_shootdown(void)
+{
+    service_TLB_shootdown();
+    APIC_end_of_interrupt();
+}
+
+void PageTable::flush_TLB(void)
+{
+    if (stale.empty()) return;
+    uint64_t start=rdtsc();
+    while (!shootdown_lock.try_lock()) {
+        service_TLB_shootdown(); // the lock holder may be waiting on us
+        pause_CPU();
+    }
+    PerCPU *cpu=this_cpu();
+    int me=cpu->index;
+    if (cpu->pagetable==this) flush_TLB_local(stale);
+    else // we ran it earlier, so our PCID may still hold stale entries: flush on activate
+        __atomic_fetch_and(&cpus_used,~(1ull<<me),__ATOMIC_SEQ_CST);
+    
+    // Cores running us right now need an IPI, one each for the whole batch.
+    uint64_t used=__atomic_load_n(&cpus_used,__ATOMIC_SEQ_CST);
+    uint64_t sent=0;
+    for (int c=0;c<percpu_count;c++) {
+        uint64_t bit=1ull<<c;
+        if (c==me) continue;
+        if (!(used&bit)) { TLB_stats.skipped++; continue; }
+        if (__atomic_load_n(&percpu[c].pagetable,__ATOMIC_SEQ_CST)!=this) 
+        { // Not running us: it loses its claim on our PCID's TLB entries,
+          //   so if it switches back to us it'll flush first.  (See activate.)
+            __atomic_fetch_and(&cpus_used,~bit,__ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&percpu[c].pagetable,__ATOMIC_SEQ_CST)!=this) { TLB_stats.lazy++; continue; }
+            __atomic_fetch_or(&cpus_used,bit,__ATOMIC_SEQ_CST); // it just switched to us
+        }
+        TLB_mailbox &m=TLB_mailboxes[c];
+        m.pagetable=this;
+        m.batch=stale;
+        __atomic_store_n(&m.pending,1,__ATOMIC_RELEASE);
+        send_IPI(percpu[c].apic_id,TLB_SHOOTDOWN_VECTOR);
+        sent|=1ull<<c;
+        TLB_stats.ipis++;
+    }
+    
+    // Wait until they've all flushed.  (A core with interrupts off only
+    //   answers if it's spinning in here too, so never park a core 
+    //   with interrupts off while it's running a PageTable.)
+    for (int c=0;c<percpu_count;c++)
+        if (sent&(1ull<<c))
+            while (__atomic_load_n(&TLB_mailboxes[c].pending,__ATOMIC_ACQUIRE)) pause_CPU();
+    
+    stale.clear();
+    TLB_stats.flushes++;
+    TLB_stats.cycles+=rdtsc()-start;
+    shootdown_lock.unlock();
+}
+
+/// After set_write_combining edits the kernel's pagemaps, make the other
+///   cores flush their TLBs.  Cores running a PageTable answer an IPI now.
+///   The rest are either parked in UEFI or in kernel code, and they catch
+///   up the next time they call setup_paging or PageTable::activate.
+void shootdown_kernel_mappings(void)
+{
+    while (!shootdown_lock.try_lock()) {
+        service_TLB_shootdown();
+        pause_CPU();
+    }
+    int me=cpu_index();
+    uint64_t sent=0;
+    for (int c=0;c<percpu_count;c++) {
+        if (c==me || __atomic_load_n(&percpu[c].pagetable,__ATOMIC_SEQ_CST)==0) continue;
+        TLB_mailbox &m=TLB_mailboxes[c];
+        m.pagetable=0; // just catch_up_kernel_mappings
+        m.batch.clear();
+        __atomic_store_n(&m.pending,1,__ATOMIC_RELEASE);
+        send_IPI(percpu[c].apic_id,TLB_SHOOTDOWN_VECTOR);
+        sent|=1ull<<c;
+        TLB_stats.ipis++;
+    }
+    for (int c=0;c<percpu_count;c++)
+        if (sent&(1ull<<c))
+            while (__atomic_load_n(&TLB_mailboxes[c].pending,__ATOMIC_ACQUIRE)) pause_CPU();
+    shootdown_lock.unlock();
+}
+
+void print_TLB_stats(void)
+{
+    print("TLB flushes: "); print((int64_t)TLB_stats.flushes);
+    print(" invlpg pages: "); print((int64_t)TLB_stats.invlpg_pages);
+    print(" full: "); print((int64_t)TLB_stats.full_flushes); println();
+    print("  shootdown IPIs: "); print((int64_t)TLB_stats.ipis);
+    print(" lazy cores: "); print((int64_t)TLB_stats.lazy);
+    print(" skipped cores: "); print((int64_t)TLB_stats.skipped);
+    if (TLB_stats.flushes) {
+        print(" average cycles: "); print((int64_t)(TLB_stats.cycles/TLB_stats.flushes));
+    }
+    println();
+}
+
+/// Physical address ranges that are memory-mapped I/O, not RAM.
+///  Pages in these ranges get caching disabled, and a large page
+///  never covers both I/O and RAM.
+struct io_ranges {
+    enum {MAX_RANGES=64};
+    int count;
+    PhysicalAddress start[MAX_RANGES], end[MAX_RANGES];
+    
+    /// Add this range
+    void add(PhysicalAddress s,PhysicalAddress e) {
+        if (count>=MAX_RANGES) panic("Too many I/O ranges: ",count);
+        start[count]=s; end[count]=e; count++;
+    }
+    
+    /// Return 0 if this range has no I/O, 1 if it's all I/O, and 2 if it's mixed.
+    int classify(PhysicalAddress s,PhysicalAddress e) const {
+        int kind=0;
+        for (int i=0;i<count;i++) {
+            if (end[i]<=s || start[i]>=e) continue; // no overlap
+            if (start[i]<=s && end[i]>=e) kind=1; // all inside this range
+            else return 2;
+        }
+        return kind;
+    }
+};
+
+/// Find the I/O ranges from UEFI's memory map, plus the legacy VGA hole.
+void find_io_ranges(io_ranges &io)
+{
+    io.count=0;
+    io.add(0xA0000,0x100000); // VGA memory and option ROMs
+    UEFI_memory_map map;
+    for (UINTN i=0;i<map.size();i++) 
+    {
+        EFI_MEMORY_DESCRIPTOR *m=map[i];
+        if (m->Type==EfiMemoryMappedIO || m->Type==EfiMemoryMappedIOPortSpace)
+            io.add(m->PhysicalStart,m->PhysicalStart+m->NumberOfPages*PageSize);
+    }
+}
+
+/// Identity map addresses base to end into this pagemap level
+///   (3: PML3, with 1GB per entry; 2: PML2, 2MB; 1: PML1, 4KB).
+///  Uses the biggest pages it can, and only splits where I/O starts or stops.
+void map_identity(pagemap_entry *pml,int level,PhysicalAddress base,PhysicalAddress end,
+    const pagemap_entry &permissions,const io_ranges &io)
+{
+    uint64_t entry_bytes=1ull<<(PAGE_BITS+PML_BITS*(level-1));
+    bool large_ok=(level==2) || (level==3 && cpu_features.pdpe1gb);
+    for (int idx=0;idx<pagemap_length;idx++)
+    {
+        PhysicalAddress addr=base+idx*entry_bytes;
+        if (addr>=end) break;
+        int kind=io.classify(addr,addr+entry_bytes);
+        
+        pml[idx]=permissions;
+        if (level==1 || (large_ok && kind!=2)) 
+        { // a leaf page
+            if (level>1) pml[idx].PAT=1; // (this bit means "large page" at these levels)
+            pml[idx].set_address((void *)addr);
+            if (kind==1) { pml[idx].PCD=1; pml[idx].PWT=1; } // uncached I/O
+        }
+        else
+        { // point down to a smaller level
+            pagemap_entry *next=allocate_pagemap();
+            pml[idx].set_address(next);
+            map_identity(next,level-1,addr,end,permissions,io);
+        }
+    }
+}
+
 /// Make pagetables with identity mapping, 
 ///   where all of RAM is readable, writeable, and executable.
 /// Works for this many gigs of RAM (usually at least 4, to get I/O devices).
+///  Uses 1GB pages if the CPU has them, otherwise 2MB pages,
+///  and 4KB pages only around the edges of I/O ranges.
 ///  Returns the new pagetable.
 pagemap_entry *make_identity_pagetable(int max_RAM_gigs=32)
 {
-    pagemap_entry *pml4=new pagemap_entry[pagemap_length]; //<- uses galloc, so it's 4KB-aligned
+    pagemap_entry *pml4=allocate_pagemap();
     pagetable_t *pagetable=pml4;
     
-    pagemap_entry *pml3=new pagemap_entry[pagemap_length];
+    pagemap_entry *pml3=allocate_pagemap();
     
     // Copy all the entry permissions from this:
     pagemap_entry permissions;
@@ -665,43 +1717,21 @@ pagemap_entry *make_identity_pagetable(int max_RAM_gigs=32)
     pml4[0]=permissions;
     pml4[0].set_address(pml3);
     
-    // pml3 has a bunch of entries set.  This works out to
-    //   one pml3 entry per gig of ram (9+9+12=30 bits per entry)
+    // pml3 has one entry per gig of ram (9+9+12=30 bits per entry)
     if (max_RAM_gigs>pagemap_length) 
         panic("Too much ram to fit in pml3!",max_RAM_gigs);
-    for (int idx3=0;idx3<max_RAM_gigs;idx3++)
-    {
-        pagemap_entry *pml2=new pagemap_entry[pagemap_length];
-        pml3[idx3]=permissions;
-        pml3[idx3].set_address(pml2);
-        
-        // PML2 just points down to PML1
-        //   we map every index as present and read/writeable
-        for (int idx2=0;idx2<pagemap_length;idx2++)
-        {
-            pagemap_entry *pml1=new pagemap_entry[pagemap_length];
-            pml2[idx2]=permissions;
-            pml2[idx2].set_address(pml1);
-            
-            // PML1 is where all the action happens:
-            //   we map every index as present and read/writeable
-            for (int idx1=0;idx1<pagemap_length;idx1++)
-            {
-                pml1[idx1]=permissions;
-                
-                uint64_t physical_page=(((idx3<<PML_BITS)+idx2)<<PML_BITS)+idx1;
-                void *physical_address=(void *)(physical_page<<PAGE_BITS);
-                pml1[idx1].set_address(physical_address);
-            }
-            
-        }
-    }
+    io_ranges io;
+    find_io_ranges(io);
+    map_identity(pml3,3,0,((uint64_t)max_RAM_gigs)<<30,permissions,io);
     return pagetable;
 }
 
 void test_pagetables(void)
 {
+    uint64_t before=pagemap_pool.count_in_use();
     pagetable_t *partytime=make_identity_pagetable(4);
+    print("Identity pagetable uses "); print((int64_t)(pagemap_pool.count_in_use()-before));
+    print(cpu_features.pdpe1gb?"pagemaps (1GB pages)\n":"pagemaps (2MB pages)\n");
     print("Map in partytime pagetable\n");
     write_pagetable(partytime);
     
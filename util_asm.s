@@ -33,6 +33,11 @@ lgdt:
     lgdt [rcx]
     ret
 
+global ltr
+ltr:
+    ltr cx
+    ret
+
 global pause_CPU
 pause_CPU:
     pause
@@ -41,13 +46,67 @@ pause_CPU:
 global read_pagetable
 read_pagetable:
     mov rax,cr3
+    and rax,-4096 ; clear the PCID bits
     ret
 
+; write_cr3 takes the raw register value (with PCID and no-flush bits)
 global write_pagetable
+global write_cr3
 write_pagetable:
+write_cr3:
     mov cr3,rcx
     ret
 
+global read_cr0
+read_cr0:
+    mov rax,cr0
+    ret
+
+global write_cr0
+write_cr0:
+    mov cr0,rcx
+    ret
+
+global read_cr4
+read_cr4:
+    mov rax,cr4
+    ret
+
+global write_cr4
+write_cr4:
+    mov cr4,rcx
+    ret
+
+; Interface: flush the TLB entry for the virtual address in rcx
+global invlpg
+invlpg:
+    invlpg [rcx]
+    ret
+
+; Flush all the (non-global) TLB entries for the current address space
+global reload_cr3
+reload_cr3:
+    mov rax,cr3 ; (the no-flush bit always reads as zero)
+    mov cr3,rax
+    ret
+
+; Interface: read model-specific register rcx, return value in rax
+global read_msr
+read_msr:
+    rdmsr ; reads edx:eax
+    shl rdx,32
+    mov eax,eax ; zero-extend the low half
+    or rax,rdx
+    ret
+
+; Interface: write model-specific register rcx with the value in rdx
+global write_msr
+write_msr:
+    mov eax,edx ; low half
+    shr rdx,32 ; high half
+    wrmsr ; writes edx:eax
+    ret
+
 global inportb
 inportb:
     mov rax,0
@@ -62,13 +121,333 @@ outportb:
     out dx,al
     ret
 
+; ------------ Memory copy and fill (dispatched by memcpy/memset in util.cpp)
+; Interface: rcx: dest, rdx: src (or the fill byte), r8: byte count.
+;   Returns dest in rax.
+;   rdi and rsi are preserved registers in the Windows ABI, so save them.
+
+; Copy with "rep movsb": fastest on CPUs with ERMS or FSRM.
+global memcpy_rep_movsb
+memcpy_rep_movsb:
+    mov rax,rcx
+    push rdi
+    push rsi
+    mov rdi,rcx
+    mov rsi,rdx
+    mov rcx,r8
+    rep movsb
+    pop rsi
+    pop rdi
+    ret
+
+; Copy with "rep movsq" then "rep movsb": works well on any x86-64.
+global memcpy_rep_movsq
+memcpy_rep_movsq:
+    mov rax,rcx
+    push rdi
+    push rsi
+    mov rdi,rcx
+    mov rsi,rdx
+    mov rcx,r8
+    shr rcx,3 ; 8-byte words
+    rep movsq
+    mov rcx,r8
+    and rcx,7 ; leftover bytes
+    rep movsb
+    pop rsi
+    pop rdi
+    ret
+
+; Copy 64 bytes at a time with AVX2 (unaligned is fine).
+global memcpy_avx2
+memcpy_avx2:
+    mov rax,rcx
+    cmp r8,64
+    jb .tail
+.loop:
+    vmovdqu ymm0,[rdx]
+    vmovdqu ymm1,[rdx+32]
+    vmovdqu [rcx],ymm0
+    vmovdqu [rcx+32],ymm1
+    add rdx,64
+    add rcx,64
+    sub r8,64
+    cmp r8,64
+    jae .loop
+    vzeroupper ; avoid slow SSE/AVX transitions later
+.tail:
+    test r8,r8
+    jz .done
+.tailloop:
+    mov r9b,[rdx]
+    mov [rcx],r9b
+    inc rdx
+    inc rcx
+    dec r8
+    jnz .tailloop
+.done:
+    ret
+
+; Copy with non-temporal (cache bypassing) stores, for copies bigger
+;   than the cache, like framebuffers.  Only needs SSE2.
+global memcpy_nontemporal
+memcpy_nontemporal:
+    mov rax,rcx
+    mov r9,r8
+    shr r9,5 ; 32-byte blocks
+    jz .tail
+.loop:
+    mov r10,[rdx]
+    mov r11,[rdx+8]
+    movnti [rcx],r10
+    movnti [rcx+8],r11
+    mov r10,[rdx+16]
+    mov r11,[rdx+24]
+    movnti [rcx+16],r10
+    movnti [rcx+24],r11
+    add rdx,32
+    add rcx,32
+    dec r9
+    jnz .loop
+    sfence ; make the stores visible to other cores
+.tail:
+    and r8,31
+    jz .done
+.tailloop:
+    mov r9b,[rdx]
+    mov [rcx],r9b
+    inc rdx
+    inc rcx
+    dec r8
+    jnz .tailloop
+.done:
+    ret
+
+; Copy overlapping memory backwards (for memmove with dest above src)
+global memcpy_backward
+memcpy_backward:
+    mov rax,rcx
+    push rdi
+    push rsi
+    lea rdi,[rcx+r8-1]
+    lea rsi,[rdx+r8-1]
+    mov rcx,r8
+    std ; count down
+    rep movsb
+    cld ; the ABI needs the direction flag clear
+    pop rsi
+    pop rdi
+    ret
+
+; Fill with "rep stosb": fastest on CPUs with ERMS.
+global memset_rep_stosb
+memset_rep_stosb:
+    mov r9,rcx
+    push rdi
+    mov rdi,rcx
+    mov eax,edx ; fill byte
+    mov rcx,r8
+    rep stosb
+    pop rdi
+    mov rax,r9
+    ret
+
+; Fill with "rep stosq" then "rep stosb"
+global memset_rep_stosq
+memset_rep_stosq:
+    mov r9,rcx
+    push rdi
+    mov rdi,rcx
+    movzx eax,dl
+    mov r10,0x0101010101010101
+    imul rax,r10 ; copy fill byte to all 8 bytes
+    mov rcx,r8
+    shr rcx,3
+    rep stosq
+    mov rcx,r8
+    and rcx,7
+    rep stosb
+    pop rdi
+    mov rax,r9
+    ret
+
+; Fill 64 bytes at a time with AVX2
+global memset_avx2
+memset_avx2:
+    mov rax,rcx
+    cmp r8,64
+    jb .tail
+    vmovd xmm0,edx
+    vpbroadcastb ymm0,xmm0
+.loop:
+    vmovdqu [rcx],ymm0
+    vmovdqu [rcx+32],ymm0
+    add rcx,64
+    sub r8,64
+    cmp r8,64
+    jae .loop
+    vzeroupper
+.tail:
+    test r8,r8
+    jz .done
+.tailloop:
+    mov [rcx],dl
+    inc rcx
+    dec r8
+    jnz .tailloop
+.done:
+    ret
+
+; Fill with non-temporal stores, for fills bigger than the cache
+global memset_nontemporal
+memset_nontemporal:
+    mov rax,rcx
+    movzx r10d,dl
+    mov r11,0x0101010101010101
+    imul r10,r11
+    mov r9,r8
+    shr r9,5 ; 32-byte blocks
+    jz .tail
+.loop:
+    movnti [rcx],r10
+    movnti [rcx+8],r10
+    movnti [rcx+16],r10
+    movnti [rcx+24],r10
+    add rcx,32
+    dec r9
+    jnz .loop
+    sfence
+.tail:
+    and r8,31
+    jz .done
+.tailloop:
+    mov [rcx],dl
+    inc rcx
+    dec r8
+    jnz .tailloop
+.done:
+    ret
+
+; Compare memory: rcx: a, rdx: b, r8: byte count.
+;   Returns eax<0 if a<b, 0 if equal, >0 if a>b (as unsigned bytes).
+global memcmp
+memcmp:
+    xor eax,eax
+.qwords: ; skip over 8 equal bytes at a time
+    cmp r8,8
+    jb .bytes
+    mov r9,[rcx]
+    cmp r9,[rdx]
+    jne .bytes ; some byte of the next 8 differs: find it below
+    add rcx,8
+    add rdx,8
+    sub r8,8
+    jmp .qwords
+.bytes:
+    test r8,r8
+    jz .done
+    movzx eax,byte[rcx]
+    movzx r9d,byte[rdx]
+    sub eax,r9d
+    jnz .done
+    inc rcx
+    inc rdx
+    dec r8
+    jmp .bytes
+.done:
+    ret
+
+
+; ---------- interrupt entry points ---------
+; The CPU pushes SS, RSP, RFLAGS, CS, RIP, and we have to come back 
+;  with iretq, so these can't be plain C++ functions.
+
+; Save the registers a win64 C++ function is allowed to trash.
+;  On entry the CPU left rsp 16-byte aligned minus 8 (5 qword frame),
+;  so after 7 pushes plus this 6*16+32 area, rsp is aligned for a call.
+%macro save_volatile_registers 0
+    push rax
+    push rcx
+    push rdx
+    push r8
+    push r9
+    push r10
+    push r11
+    sub rsp,6*16+32 ; xmm0-5, plus the win64 shadow space
+    movdqu [rsp+32+0*16],xmm0
+    movdqu [rsp+32+1*16],xmm1
+    movdqu [rsp+32+2*16],xmm2
+    movdqu [rsp+32+3*16],xmm3
+    movdqu [rsp+32+4*16],xmm4
+    movdqu [rsp+32+5*16],xmm5
+%endmacro
+
+%macro restore_volatile_registers 0
+    movdqu xmm0,[rsp+32+0*16]
+    movdqu xmm1,[rsp+32+1*16]
+    movdqu xmm2,[rsp+32+2*16]
+    movdqu xmm3,[rsp+32+3*16]
+    movdqu xmm4,[rsp+32+4*16]
+    movdqu xmm5,[rsp+32+5*16]
+    add rsp,6*16+32
+    pop r11
+    pop r10
+    pop r9
+    pop r8
+    pop rdx
+    pop rcx
+    pop rax
+%endmacro
+
+; Interrupts from user code arrive with the user's GS base, so swap
+;  in our PerCPU.  The argument is the offset of the CPU-pushed CS on 
+;  the stack, whose low bits are the privilege level we came from.
+%macro swapgs_if_from_user 1
+    test QWORD[rsp+%1],3
+    jz %%from_kernel
+    swapgs
+%%from_kernel:
+%endmacro
+
+; TLB shootdown IPI from another core (see PageTable::flush_TLB)
+extern handle_TLB_shootdown
+global TLB_shootdown_entry
+TLB_shootdown_entry:
+    swapgs_if_from_user 8
+    save_volatile_registers
+    call handle_TLB_shootdown
+    restore_volatile_registers
+    swapgs_if_from_user 8
+    iretq
+
+
+; Page fault (#PF).  The CPU also pushes an error code, and puts the
+;  address that faulted into cr2.  handle_page_fault only returns if 
+;  it fixed the fault, and then we retry the instruction.
+extern handle_page_fault
+global page_fault_entry
+page_fault_entry:
+    swapgs_if_from_user 16
+    sub rsp,8 ; keep the stack aligned (the error code shifted it)
+    save_volatile_registers
+    mov rcx,cr2 ; address that faulted
+    mov rdx,[rsp+6*16+32+7*8+8] ; error code
+    mov r8,[rsp+6*16+32+7*8+8+8] ; address of the instruction that faulted
+    call handle_page_fault
+    restore_volatile_registers
+    add rsp,8+8 ; alignment and error code
+    swapgs_if_from_user 8
+    iretq
+
+
 ; ---------- stack handling ---------
+;  User code runs in ring 3.  Its syscalls (and interrupts) switch to 
+;  this core's kernel stack, PerCPU.kernel_stack at gs:16, which is also
+;  where return_to_main_stack takes us back to.  The TSS rsp0 (the TSS 
+;  pointer is at gs:32) has to match it, for interrupts.
 
-; start_function_with_stack
-;   rcx: function f to run with new stack
-;   rdx: pointer to the new stack
-global start_function_with_stack
-start_function_with_stack:
+; Save the kernel's preserved registers, and make this the kernel stack
+%macro push_kernel_stack 0
     push rdi ; save all the Windows preserved registers, so we can jump out of the program
     push rsi
     push rbx
@@ -78,23 +457,73 @@ start_function_with_stack:
     push r14
     push r15
     
-    mov rax,kernel_main_stack
-    mov QWORD[rax],rsp
-        mov rsp,rdx ; load up new stack
-        
-        mov rdx,atexit_empty ; ABI wants a function pointer
-        mov rbp,0 ; ABI says this should be zero at the deepest frame
-        
-        call rcx ; call f using new stack
-        
-    ; f returned, go back to main (like exit)
-    jmp return_to_main_stack
+    push QWORD[gs:16] ; save the outer program's kernel stack (or 0)
+    mov QWORD[gs:16],rsp
+    mov rax,QWORD[gs:32]
+    mov QWORD[rax+4],rsp ; TSS rsp0
+%endmacro
+
+; Drop to ring 3: rcx is the user code address, r11 its flags.
+;  Call with interrupts off, since the stack and GS become the user's.
+%macro sysret_to_user 0
+    swapgs ; user's GS base in, our PerCPU goes back to KERNEL_GS_BASE
+    o64 sysret
+%endmacro
+
+; start_function_with_stack
+;   rcx: user code address f to run 
+;   rdx: pointer to the new (user) stack
+;  f must not return, it leaves by calling exit (return_to_main_stack).
+;  These nest: a program can start another (see start_with_registers),
+;  and return_to_main_stack goes back to the innermost one.
+global start_function_with_stack
+start_function_with_stack:
+    push_kernel_stack
+    
+    pushfq
+    pop r11 ; user code gets our flags (including interrupts on)
+    cli
+    mov rsp,rdx ; load up new stack
+    xor edx,edx ; ABI: no atexit function for the program to register
+    xor ebp,ebp ; ABI says this should be zero at the deepest frame
+    xor eax,eax
+    sysret_to_user
+
+; start_with_registers
+;   rcx: pointer to SyscallRegisters for the code to run (e.g., a forked child)
+;   rdx: value for rax when it starts
+;  Returns when that code calls return_to_main_stack.
+global start_with_registers
+start_with_registers:
+    push_kernel_stack
+    
+    mov rax,rdx
+    mov rdi,QWORD[rcx+0x00] ; syscall args
+    mov rsi,QWORD[rcx+0x08]
+    mov rdx,QWORD[rcx+0x10]
+    mov r10,QWORD[rcx+0x18]
+    mov r8, QWORD[rcx+0x20]
+    mov r9, QWORD[rcx+0x28]
+    mov rbx,QWORD[rcx+0x30] ; preserved registers
+    mov rbp,QWORD[rcx+0x38]
+    mov r12,QWORD[rcx+0x40]
+    mov r13,QWORD[rcx+0x48]
+    mov r14,QWORD[rcx+0x50]
+    mov r15,QWORD[rcx+0x58]
+    mov r11,QWORD[rcx+0x68] ; user flags
+    cli
+    mov rsp,QWORD[rcx+0x70] ; user stack
+    mov rcx,QWORD[rcx+0x60] ; user code address
+    sysret_to_user
 
 global return_to_main_stack
 return_to_main_stack:
     ; Restore main stack, exit from start_function_with_stack
-    mov rax,kernel_main_stack
-    mov rsp,QWORD[rax]
+    mov rsp,QWORD[gs:16]
+    pop rax ; back to the outer program's kernel stack
+    mov QWORD[gs:16],rax
+    mov rcx,QWORD[gs:32]
+    mov QWORD[rcx+4],rax ; TSS rsp0
     
     pop r15
     pop r14
@@ -107,15 +536,11 @@ return_to_main_stack:
     mov rax,3
     ret
 
-; This is a placeholder, the ABI wants an atexit function here.
-atexit_empty:
-    ret
-
 ; -------------- syscall handling ---------
 ; See https://wiki.osdev.org/SYSENTER
 ; See MSRs at: https://www.sandpile.org/x86/msr.htm
 
-; Sets up syscall handling
+; Sets up syscall handling on this core
 global syscall_setup
 syscall_setup:
     
@@ -132,88 +557,125 @@ syscall_setup:
     or rax,1 ; set bit 0
     wrmsr ; write it
     
-    ; GDT magic: Set the segment numbers for the kernel
-    mov rax,0 ; segment numbers get stored here
-    mov rax,0x00380038; we use UEFI's code segment 0x38, and we set up data at 0x40
-    shl rax,32 ; code segment starts at bit 32 of STAR
+    ; GDT magic: Set the segment numbers (see SEGMENT_ in CPU.h)
+    ;   syscall uses UEFI's code segment 0x38, and our data at 0x40.
+    ;   sysret uses base 0x48: user data at 0x50, user code at 0x58, ring 3.
+    mov edx,0x00480038 ; STAR high half: sysret base, then syscall base
+    mov eax,0
     mov rcx, 0xC0000081 ; STAR: syscall segments for code and stack
     wrmsr 
     
-    mov rax,0
+    ; Syscalls start with interrupts off (until we're on our own stack
+    ;  and GS), and with trace, direction, alignment check, and NT clear.
+    mov edx,0
+    mov eax,0x47700 ; AC | NT | IOPL | DF | IF | TF
     mov rcx,0xC0000084 ; FMASK: mask flag bits for SYSCALL 
-    ; FIXME: mask the trace flag?
+    wrmsr
     
-    ;cli ; Avoid inconsistent failures by turning off interrupts?
+    ; User code's GS base, swapped in by swapgs (it doesn't use one)
+    mov eax,0
+    mov rcx,0xC0000102 ; KERNEL_GS_BASE
+    wrmsr
     
     ret
 
 global syscall_finish
 syscall_finish:
-    ; We need to restore CS here for UEFI stuff to work again,
-    ; but we crash trying to restore UEFI code segment.
-    ; (We need our own GDT / IDT!)
-    ;mov rax, restore_uefi
-    ;push 0x38 
-    ;push rax
-    ;rex64 retf
-    ;restore_uefi:
-    
-    ;mov ax,0x30 ; <- uefi's stack segment
-    ;mov ss,ax
-    
-    ;sti ; restore interrupts
-    
     ret
 
 
+; user_syscall_benchmark: user code for benchmark_syscalls (in run_linux.cpp),
+;  which copies these bytes into a user page, so they must not reference
+;  anything outside themselves.  Makes SYSCALL_BENCHMARK_CALLS getpid syscalls,
+;  then exits with the clock cycles they took.
+SYSCALL_BENCHMARK_CALLS equ 10000 ; <- same as in run_linux.cpp
+global user_syscall_benchmark
+global user_syscall_benchmark_end
+user_syscall_benchmark:
+    rdtsc
+    shl rdx,32
+    or rax,rdx
+    mov r12,rax ; start time (preserved across syscalls)
+    mov r13d,SYSCALL_BENCHMARK_CALLS
+.loop:
+    mov eax,39 ; getpid
+    syscall
+    dec r13d
+    jnz .loop
+    
+    rdtsc
+    shl rdx,32
+    or rax,rdx
+    sub rax,r12
+    mov rdi,rax ; exit code: elapsed cycles
+    mov eax,60 ; exit
+    syscall
+user_syscall_benchmark_end:
+
+
 ; The address of this function gets loaded into the CPU's
 ;  machine-specific register to handle syscall instructions.
 ;  On entry: 
-;     rsp is the user's stack
+;     rsp is the user's stack, and GS is the user's
 ;     rcx contains the user's return address
 ;     r11 contains RFLAGS
+;     interrupts are off (see FMASK)
+;  We run the handler on this core's kernel stack (so a fork can switch 
+;  address spaces under the user's stack, and every core can be in a 
+;  syscall at once), and save the user's registers there as a 
+;  SyscallRegisters struct.
 extern handle_syscall
 global syscall_entry
 syscall_entry:
-    sub rsp,128 ; avoid Linux "red zone" next to user code
-    push rcx ; <- CPU saved the user code address here
+    swapgs ; GS base is now our PerCPU
+    mov QWORD[gs:24],rsp ; PerCPU.user_rsp
+    mov rsp,QWORD[gs:16] ; PerCPU.kernel_stack
     
-    ; Save the user's syscall parameters where we can read them
-    mov rcx,syscall_parameters
-    mov QWORD[rcx+0x00],rdi ; Linux syscall arg 0
-    mov QWORD[rcx+0x08],rsi ; Linux syscall arg 1
-    mov QWORD[rcx+0x10],rdx ; Linux syscall arg 2
-    mov QWORD[rcx+0x18],r10 ; Linux syscall arg 3
-    mov QWORD[rcx+0x20],r8 ; Linux syscall arg 4
-    mov QWORD[rcx+0x28],r9 ; Linux syscall arg 5
+    push QWORD[gs:24] ; user stack
+    push r11 ; <- CPU saved the user's flags here
+    push rcx ; <- CPU saved the user code address here
+    push r15 ; registers Linux code expects us to preserve
+    push r14
+    push r13
+    push r12
+    push rbp
+    push rbx
+    push r9 ; Linux syscall arg 5
+    push r8 ; Linux syscall arg 4
+    push r10 ; Linux syscall arg 3
+    push rdx ; Linux syscall arg 2
+    push rsi ; Linux syscall arg 1
+    push rdi ; Linux syscall arg 0
     
+    test r11,0x200 ; did the user have interrupts on?
+    jz .call
+    sti ; safe now, we're on our own stack
+.call:
     ; Call our high level syscall handler
-    sub rsp,32+8 ; <- win64 call convention wants this
+    mov rbx,rsp ; <- pointer to saved registers
+    and rsp,-16
+    sub rsp,32 ; <- win64 call convention wants this
     ; win64 call: (rcx,rdx,...)
-    mov rdx,rcx; <- pointer to syscall args
+    mov rdx,rbx
     mov rcx,rax; <- store syscall number
     call handle_syscall
-    add rsp,32+8
+    cli ; the stack and GS are about to be the user's again
+    mov rsp,rbx
     
-    pop rcx ; pop the user return address we saved
-    add rsp,128
-    jmp rcx ; <- return back to user code
-    ; (could use "sysret" to change permission segments instead)
-
-
-
-section .data
-;  CAUTION: the UEFI dynamic loader relocates this file,
-;   so addresses DO NOT WORK unless loaded with this exact format:
-;    mov r*x, *symbolname* 
-;  In particular, accesses like [*symbolname*] won't get relocated!
-
-; Saved pointer to the UEFI-allocated main stack (efi_main)
-kernel_main_stack:
-    dq 0
-
-align 16
-; This space is used for storing the parameters to a syscall.
-syscall_parameters:
-    times 6 dq 0
+    pop rdi
+    pop rsi
+    pop rdx
+    pop r10
+    pop r8
+    pop r9
+    pop rbx
+    pop rbp
+    pop r12
+    pop r13
+    pop r14
+    pop r15
+    pop rcx ; the user return address we saved
+    pop r11 ; the user's flags
+    pop rsp ; back to the user's stack
+    sysret_to_user
 